@@ -17,10 +17,17 @@
 #include "acrotorcraft.h"
 
 #include <err.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
+#include <atomic>
 #include <cfloat>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <vector>
 
 #include <Eigen/Core>
 #include <Eigen/Dense>
@@ -28,6 +35,16 @@
 
 #include <codels.h>
 
+#define mk_calibration_chunk	0.02	/* max gyroscope chunk rotation, rad */
+#define mk_calibration_bins	8	/* magnetometer bins per cube face side */
+
+/* samples storage precision */
+#ifdef CALIBRATION_FLOAT
+typedef float mk_calibration_real;
+#else
+typedef double mk_calibration_real;
+#endif
+
 /*
  * This file implements the work described in:
  *
@@ -39,110 +56,381 @@
 
 /* --- local data ---------------------------------------------------------- */
 
-struct mk_calibration_data {
+struct mk_calibration_solver;
+
+/* Samples are first stored in a ring buffer holding the last sstill + sps + 1
+ * samples, which is enough to update the variance over the last second and to
+ * know, when a sample leaves the ring, whether it is part of a still
+ * interval: still intervals are detected sstill + sps/2 samples late. Samples
+ * of still intervals are then kept in full, while all samples are reduced
+ * into chunks, so that the memory depends on the number of poses and not on
+ * the duration of the session. */
+
+struct mk_calibration_samples {
+  Eigen::Matrix<mk_calibration_real, 1, Eigen::Dynamic> temp;
+  Eigen::Matrix<mk_calibration_real, 3, Eigen::Dynamic> gyr;
+  Eigen::Matrix<mk_calibration_real, 3, Eigen::Dynamic> acc;
+  Eigen::Matrix<mk_calibration_real, 3, Eigen::Dynamic> mag;
+  Eigen::Array<mk_calibration_real, 6, Eigen::Dynamic> moq;
+};
+
+/* Consecutive samples, either all still or all in motion, along which the
+ * gyroscope path length stays below mk_calibration_chunk rad. With a = dt.g
+ * the raw gyroscope samples, alpha = sum(a_k), beta = sum(a_j x a_k) for
+ * j < k, t = sum(dt_k) and r = sum(dt_k.alpha_<k - t_<k.a_k), where _<k
+ * denotes partial sums, the same sums of the samples corrected by a bias b
+ * are alpha + t.b and beta + r x b. Other data is summed for the means and
+ * the magnetometer covariance. */
+
+struct mk_calibration_chunk_s {
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+
+  int32_t n;
+  double t, path;
+  Eigen::Matrix<double, 3, 1> alpha, beta, r;
+
+  double temp;
+  Eigen::Matrix<double, 3, 1> gyr, acc, mag;
+  Eigen::Matrix<double, 3, 3> magsq;
+  Eigen::Matrix<double, 6, 1> moq;
+};
+
+/* Calibration context, created by mk_calibration_init() and released by
+ * mk_calibration_fini(), mk_calibration_result() or mk_calibration_cancel().
+ * Contexts are independent from each other. */
+
+struct rotorcraft_calibration_s {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
 
   int32_t sps, sstill, nposes;
 
-  Eigen::Matrix<double, 1, Eigen::Dynamic> t;
-  Eigen::Matrix<double, 1, Eigen::Dynamic> temp;
-  Eigen::Matrix<double, 3, Eigen::Dynamic> gyr;
-  Eigen::Matrix<double, 3, Eigen::Dynamic> acc;
-  Eigen::Matrix<double, 3, Eigen::Dynamic> mag;
-  int32_t samples;
+  mk_calibration_samples ring;
+  Eigen::Matrix<mk_calibration_real, 1, Eigen::Dynamic> dt;
+  int32_t samples, flushed;
+  double t;
   or_time_ts ts;
 
-  Eigen::Array<double, 6, Eigen::Dynamic> moq;
   Eigen::Array<double, 6, 1> sum, sumsq, varth;
   double tolerance;
 
   Eigen::Array<int32_t, 2, Eigen::Dynamic> still;
   int32_t nstill;
+
+  /* samples of still intervals */
+  mk_calibration_samples kept;
+  int32_t nkept, capacity, maxkept;
+
+  /* chunks, the last one being filled */
+  std::vector<mk_calibration_chunk_s,
+              Eigen::aligned_allocator<mk_calibration_chunk_s> > chunk;
+
+  /* first and last kept sample, first and last chunk of each still
+   * interval, with -1 as the last ones while the interval is not over */
+  Eigen::Array<int32_t, 4, Eigen::Dynamic> pose;
+
+  /* statistics of all samples. accext and gyrext are the samples with the
+   * highest and lowest value of each axis, calibrated along with kept
+   * samples so that their maxima are those of the calibrated samples. */
+  double sumtemp;
+  Eigen::Matrix<double, 3, 1> magmin, magmax;
+  Eigen::Matrix<double, 3, 6> accext, gyrext;
+
+  mk_calibration_solver *solver;
 };
 
-static mk_calibration_data *raw_data;
+/* background solver */
+struct mk_calibration_solver {
+  pthread_t thread;
+  std::atomic<bool> done, cancel;
+
+  rotorcraft_calibration_s *calib;
+  bool imu, mag;
+  char path[64];
+  rotorcraft_ids_imu_calibration_s cal;
+  double maxa[3], maxw[3], avga, avgw;
+  int s;
+};
+
+/* Whether the background solver is being cancelled. Error functions then
+ * fail, which aborts the minimization with UserAsked. */
+static inline bool
+mk_calibration_cancelled(const rotorcraft_calibration_s *calib)
+{
+  return calib->solver &&
+    calib->solver->cancel.load(std::memory_order_relaxed);
+}
+
+
+/* --- mk_calibration_reserve ---------------------------------------------- */
+
+/* Resize samples storage to n samples */
+
+static int
+mk_calibration_reserve(mk_calibration_samples &s, int32_t n)
+{
+  try {
+    s.temp.conservativeResize(n);
+    s.gyr.conservativeResize(Eigen::NoChange, n);
+    s.acc.conservativeResize(Eigen::NoChange, n);
+    s.mag.conservativeResize(Eigen::NoChange, n);
+    s.moq.conservativeResize(Eigen::NoChange, n);
+  } catch (std::bad_alloc &) {
+    return ENOMEM;
+  }
+
+  return 0;
+}
+
+
+/* --- mk_calibration_clear ------------------------------------------------ */
+
+static void
+mk_calibration_clear(mk_calibration_chunk_s &c)
+{
+  c.n = 0;
+  c.t = c.path = 0.;
+  c.alpha.setZero();
+  c.beta.setZero();
+  c.r.setZero();
+
+  c.temp = 0.;
+  c.gyr.setZero();
+  c.acc.setZero();
+  c.mag.setZero();
+  c.magsq.setZero();
+  c.moq.setZero();
+}
 
 
 /* --- mk_calibration_init ------------------------------------------------- */
 
 int
-mk_calibration_init(uint32_t sstill, uint32_t nposes, uint32_t sps,
+mk_calibration_init(rotorcraft_calibration_s **calibration,
+                    uint32_t sstill, uint32_t nposes, uint32_t sps,
                     double tolerance)
 {
-  raw_data = new(mk_calibration_data);
-  if (!raw_data) return ENOMEM;
+  rotorcraft_calibration_s *calib;
+  int s;
+
+  calib = new(rotorcraft_calibration_s);
+  if (!calib) return ENOMEM;
+
+  calib->sps = sps;
+  calib->sstill = sstill;
+  calib->nposes = nposes;
+
+  /* a still interval is bounded by 30 times sstill samples. Start with room
+   * for nominal intervals of about sstill + sps samples, and double the
+   * capacity when needed up to that bound. */
+  calib->maxkept = std::min<int64_t>(
+    INT32_MAX, (int64_t)nposes * (30 * (int64_t)sstill + 1));
+  calib->capacity = std::min<int64_t>(
+    calib->maxkept, (int64_t)nposes * (sstill + sps));
+  s = mk_calibration_reserve(calib->ring, sstill + sps + 1);
+  if (!s) s = mk_calibration_reserve(calib->kept, calib->capacity);
+  if (!s) {
+    try {
+      calib->dt.resize(sstill + sps + 1);
+      calib->chunk.reserve((nposes + 1) * 128);
+      calib->chunk.resize(1);
+    } catch (std::bad_alloc &) {
+      s = ENOMEM;
+    }
+  }
+  if (s) {
+    delete calib;
+    return s;
+  }
+  calib->samples = calib->flushed = calib->nkept = 0;
+  calib->t = 0.;
+  calib->ts.sec = calib->ts.nsec = 0;
+
+  calib->sum << 0., 0., 0., 0., 0., 0.;
+  calib->sumsq << 0., 0., 0., 0., 0., 0.;
+  calib->varth << 1., 1., 1., 1., 1., 1.;
+  calib->tolerance = tolerance;
+
+  calib->still.resize(Eigen::NoChange, 0);
+  calib->nstill = 0;
+
+  mk_calibration_clear(calib->chunk.back());
+  calib->pose.resize(Eigen::NoChange, 0);
+
+  calib->sumtemp = 0.;
+  calib->magmin.setConstant(DBL_MAX);
+  calib->magmax.setConstant(-DBL_MAX);
+  calib->accext.setZero();
+  calib->gyrext.setZero();
+
+  calib->solver = NULL;
+
+  *calibration = calib;
+  return 0;
+}
+
+
+/* --- mk_calibration_close ------------------------------------------------ */
+
+/* Start a new chunk if the current one is not empty, and return the index of
+ * the last complete chunk */
+
+static int32_t
+mk_calibration_close(rotorcraft_calibration_s *calib)
+{
+  std::vector<mk_calibration_chunk_s,
+              Eigen::aligned_allocator<mk_calibration_chunk_s> > &c =
+    calib->chunk;
+
+  if (c.back().n) {
+    c.resize(c.size() + 1);
+    mk_calibration_clear(c.back());
+  }
+
+  return c.size() - 2;
+}
+
+
+/* --- mk_calibration_flush ------------------------------------------------ */
+
+/* Reduce the kth sample, leaving the ring buffer */
+
+static int
+mk_calibration_flush(rotorcraft_calibration_s *calib, int32_t k)
+{
+  const mk_calibration_samples &r = calib->ring;
+  mk_calibration_samples &p = calib->kept;
+  Eigen::Matrix<double, 3, 1> g, a, m;
+  int32_t i, j;
+  double dt;
+  int s;
 
-  raw_data->sps = sps;
-  raw_data->sstill = sstill;
-  raw_data->nposes = nposes;
+  /* end of the current still interval */
+  i = calib->pose.cols() - 1;
+  if (i >= 0 && calib->pose(1, i) < 0 && k > calib->still(1, i)) {
+    calib->pose(1, i) = calib->nkept - 1;
+    calib->pose(3, i) = mk_calibration_close(calib);
+  }
 
-  raw_data->temp.resize(Eigen::NoChange, sps);
-  raw_data->gyr.resize(Eigen::NoChange, sps);
-  raw_data->acc.resize(Eigen::NoChange, sps);
-  raw_data->mag.resize(Eigen::NoChange, sps);
-  raw_data->samples = 0;
-  raw_data->ts.sec = raw_data->ts.nsec = 0;
+  /* beginning of the next still interval */
+  i = calib->pose.cols();
+  if (i < calib->still.cols() && k >= calib->still(0, i)) {
+    mk_calibration_close(calib);
+    calib->pose.conservativeResize(Eigen::NoChange, i + 1);
+    calib->pose.col(i) <<
+      calib->nkept, -1, calib->chunk.size() - 1, -1;
+  }
 
-  raw_data->sum << 0., 0., 0., 0., 0., 0.;
-  raw_data->sumsq << 0., 0., 0., 0., 0., 0.;
-  raw_data->varth << 1., 1., 1., 1., 1., 1.;
-  raw_data->tolerance = tolerance;
+  /* keep still samples, doubling storage capacity when full */
+  j = k % r.temp.cols();
+  i = calib->pose.cols() - 1;
+  if (i >= 0 && calib->pose(1, i) < 0) {
+    if (calib->nkept >= calib->capacity) {
+      if (calib->capacity >= calib->maxkept) return EFBIG;
+      s = mk_calibration_reserve(p, std::min<int64_t>(
+                                   calib->maxkept,
+                                   2 * (int64_t)calib->capacity));
+      if (s) return s;
+      calib->capacity = p.temp.cols();
+    }
 
-  raw_data->still.resize(Eigen::NoChange, 0);
-  raw_data->nstill = 0;
+    p.temp(calib->nkept) = r.temp(j);
+    p.gyr.col(calib->nkept) = r.gyr.col(j);
+    p.acc.col(calib->nkept) = r.acc.col(j);
+    p.mag.col(calib->nkept) = r.mag.col(j);
+    p.moq.col(calib->nkept) = r.moq.col(j);
+    calib->nkept++;
+  }
 
+  /* integrate the current chunk */
+  mk_calibration_chunk_s &c = calib->chunk.back();
+
+  dt = calib->dt(j);
+  g = r.gyr.col(j).cast<double>();
+  a = r.acc.col(j).cast<double>();
+  m = r.mag.col(j).cast<double>();
+
+  c.n++;
+  c.r += dt * c.alpha - c.t * dt * g;
+  c.beta += c.alpha.cross(dt * g);
+  c.alpha += dt * g;
+  c.t += dt;
+  c.path += dt * g.norm();
+
+  c.temp += r.temp(j);
+  c.gyr += g;
+  c.acc += a;
+  c.mag += m;
+  c.magsq.noalias() += m * m.transpose();
+  c.moq += r.moq.col(j).cast<double>().matrix();
+
+  if (c.path >= mk_calibration_chunk) mk_calibration_close(calib);
+
+  /* statistics of all samples */
+  calib->sumtemp += r.temp(j);
+  calib->magmin = calib->magmin.cwiseMin(m);
+  calib->magmax = calib->magmax.cwiseMax(m);
+  for(i = 0; i < 3; i++) {
+    if (!calib->flushed || a(i) > calib->accext(i, i))
+      calib->accext.col(i) = a;
+    if (!calib->flushed || a(i) < calib->accext(i, 3 + i))
+      calib->accext.col(3 + i) = a;
+    if (!calib->flushed || g(i) > calib->gyrext(i, i))
+      calib->gyrext.col(i) = g;
+    if (!calib->flushed || g(i) < calib->gyrext(i, 3 + i))
+      calib->gyrext.col(3 + i) = g;
+  }
+
+  calib->flushed = k + 1;
   return 0;
 }
 
 
 /* --- mk_calibration_collect ---------------------------------------------- */
 
-int
-mk_calibration_collect(double temp,
-                       or_pose_estimator_state *imu_data,
-                       or_pose_estimator_state *mag_data, int32_t *still)
+static int
+mk_calibration_sample(rotorcraft_calibration_s *calib, double temp,
+                      or_pose_estimator_state *imu_data,
+                      or_pose_estimator_state *mag_data, int32_t *still)
 {
+  mk_calibration_samples &r = calib->ring;
   Eigen::Array<double, 6, 1> samp, var;
+  int32_t j;
+  double t;
+  int s;
 
   *still = -1;
 
   /* check data */
   if (!imu_data->avel._present || !imu_data->acc._present) return EIO;
-  if (imu_data->ts.sec == raw_data->ts.sec &&
-      imu_data->ts.nsec == raw_data->ts.nsec) return EAGAIN;
+  if (imu_data->ts.sec == calib->ts.sec &&
+      imu_data->ts.nsec == calib->ts.nsec) return EAGAIN;
 
 
-  /* collect raw sample */
+  /* reduce the oldest sample and collect raw sample in its place */
 
-  if (raw_data->t.cols() <= raw_data->samples)
-    raw_data->t.conservativeResize(raw_data->t.cols() + raw_data->sps);
-  raw_data->t(raw_data->samples) =
-    imu_data->ts.sec + 1e-9 * imu_data->ts.nsec;
+  j = calib->samples % r.temp.cols();
+  if (calib->samples >= r.temp.cols()) {
+    s = mk_calibration_flush(calib, calib->samples - r.temp.cols());
+    if (s) return s;
+  }
+
+  t = imu_data->ts.sec + 1e-9 * imu_data->ts.nsec;
+  calib->dt(j) = calib->samples ? t - calib->t : 0.;
+  calib->t = t;
 
-  if (raw_data->temp.cols() <= raw_data->samples)
-    raw_data->temp.conservativeResize(raw_data->temp.cols() + raw_data->sps);
-  raw_data->temp(raw_data->samples) = temp;
+  r.temp(j) = temp;
 
-  if (raw_data->gyr.cols() <= raw_data->samples)
-    raw_data->gyr.conservativeResize(Eigen::NoChange,
-                                    raw_data->gyr.cols() + raw_data->sps);
-  raw_data->gyr.col(raw_data->samples) <<
+  r.gyr.col(j) <<
     imu_data->avel._value.wx,
     imu_data->avel._value.wy,
     imu_data->avel._value.wz;
 
-  if (raw_data->acc.cols() <= raw_data->samples)
-    raw_data->acc.conservativeResize(Eigen::NoChange,
-                                    raw_data->acc.cols() + raw_data->sps);
-  raw_data->acc.col(raw_data->samples) <<
+  r.acc.col(j) <<
     imu_data->acc._value.ax,
     imu_data->acc._value.ay,
     imu_data->acc._value.az;
 
-  if (raw_data->mag.cols() <= raw_data->samples)
-    raw_data->mag.conservativeResize(Eigen::NoChange,
-                                     raw_data->mag.cols() + raw_data->sps);
-  raw_data->mag.col(raw_data->samples) <<
+  r.mag.col(j) <<
     mag_data->att._value.qx,
     mag_data->att._value.qy,
     mag_data->att._value.qz;
@@ -151,66 +439,65 @@ mk_calibration_collect(double temp,
   /* compute accelerometer and gyroscope variance over the last second */
 
   samp <<
-    raw_data->acc.col(raw_data->samples),
-    raw_data->gyr.col(raw_data->samples);
-  raw_data->sum += samp;
-  raw_data->sumsq += samp * samp;
+    r.acc.col(j).cast<double>(),
+    r.gyr.col(j).cast<double>();
+  calib->sum += samp;
+  calib->sumsq += samp * samp;
 
-  if (raw_data->samples >= raw_data->sps) {
+  if (calib->samples >= calib->sps) {
+    j = (calib->samples - calib->sps) % r.temp.cols();
     samp <<
-      raw_data->acc.col(raw_data->samples - raw_data->sps),
-      raw_data->gyr.col(raw_data->samples - raw_data->sps);
-    raw_data->sum -= samp;
-    raw_data->sumsq -= samp * samp;
+      r.acc.col(j).cast<double>(),
+      r.gyr.col(j).cast<double>();
+    calib->sum -= samp;
+    calib->sumsq -= samp * samp;
 
     var =
-      (raw_data->sumsq - raw_data->sum * raw_data->sum / raw_data->sps) /
-      raw_data->sps;
+      (calib->sumsq - calib->sum * calib->sum / calib->sps) /
+      calib->sps;
     var = sqrt(var.max(0.));
     /* global min variance, but do not go below 1e-4 to avoid
      * numerical unstability. 1e-4 variance is in any case precise enough. */
-    raw_data->varth =
-      raw_data->varth.min( (var < 1e-4).select(raw_data->varth, var) );
+    calib->varth =
+      calib->varth.min( (var < 1e-4).select(calib->varth, var) );
   }
 
-  if (raw_data->moq.cols() <= raw_data->samples)
-    raw_data->moq.conservativeResize(
-      Eigen::NoChange, raw_data->moq.cols() + raw_data->sps);
-  if (raw_data->samples >= raw_data->sps)
-    raw_data->moq.col(raw_data->samples) = var / raw_data->varth;
+  j = calib->samples % r.temp.cols();
+  if (calib->samples >= calib->sps)
+    r.moq.col(j) = (var / calib->varth).cast<mk_calibration_real>();
   else
-    raw_data->moq.col(raw_data->samples).setConstant(nan(""));
+    r.moq.col(j).setConstant(nan(""));
 
 
   /* detect still poses */
-  if (raw_data->samples > 2 * raw_data->sps) {
-    if ((var < raw_data->tolerance * raw_data->varth).all()) {
-      if (!raw_data->nstill)
+  if (calib->samples > 2 * calib->sps) {
+    if ((var < calib->tolerance * calib->varth).all()) {
+      if (!calib->nstill)
         *still = 0;
 
-      raw_data->nstill++;
-      if (raw_data->nstill == raw_data->sstill) {
-        raw_data->still.conservativeResize(
-          Eigen::NoChange, raw_data->still.cols() + 1);
-        raw_data->still(0, raw_data->still.cols()-1) =
-          raw_data->samples - raw_data->sstill - raw_data->sps/2;
+      calib->nstill++;
+      if (calib->nstill == calib->sstill) {
+        calib->still.conservativeResize(
+          Eigen::NoChange, calib->still.cols() + 1);
+        calib->still(0, calib->still.cols()-1) =
+          calib->samples - calib->sstill - calib->sps/2;
 
-        *still = raw_data->still.cols();
+        *still = calib->still.cols();
       }
-      if (raw_data->nstill > 30 * raw_data->sstill)
+      if (calib->nstill > 30 * calib->sstill)
         return EFBIG;
-      else if (raw_data->nstill >= raw_data->sstill) {
-        raw_data->still(1, raw_data->still.cols()-1) =
-          raw_data->samples - raw_data->sps/2;
+      else if (calib->nstill >= calib->sstill) {
+        calib->still(1, calib->still.cols()-1) =
+          calib->samples - calib->sps/2;
       }
     } else {
-      raw_data->nstill = 0;
-      if (raw_data->still.cols() > 0) {
-        if (raw_data->samples - raw_data->still(1, raw_data->still.cols()-1) >
-            30 * raw_data->sstill)
+      calib->nstill = 0;
+      if (calib->still.cols() > 0) {
+        if (calib->samples - calib->still(1, calib->still.cols()-1) >
+            30 * calib->sstill)
           return EFBIG;
       } else {
-        if (raw_data->samples > 30 * raw_data->sstill)
+        if (calib->samples > 30 * calib->sstill)
           return EFBIG;
       }
     }
@@ -218,16 +505,278 @@ mk_calibration_collect(double temp,
 
 
   /* next sample */
-  raw_data->samples++;
-  raw_data->ts = imu_data->ts;
+  calib->samples++;
+  calib->ts = imu_data->ts;
 
-  return (raw_data->still.cols() < raw_data->nposes) ? EAGAIN : 0;
+  return (calib->still.cols() < calib->nposes) ? EAGAIN : 0;
 }
 
+/* When the collection is over, successfully or not, the samples remaining in
+ * the ring buffer are reduced and the last chunk and still interval
+ * closed. */
 
-/* --- mk_calibration_acc -------------------------------------------------- */
+int
+mk_calibration_collect(rotorcraft_calibration_s *calib, double temp,
+                       or_pose_estimator_state *imu_data,
+                       or_pose_estimator_state *mag_data, int32_t *still)
+{
+  int32_t i;
+  int s, e;
+
+  try {
+    s = mk_calibration_sample(calib, temp, imu_data, mag_data, still);
+    if (s == EAGAIN) return s;
+
+    e = 0;
+    while(!e && calib->flushed < calib->samples)
+      e = mk_calibration_flush(calib, calib->flushed);
+    if (e) s = e;
+  } catch (std::bad_alloc &) {
+    s = ENOMEM;
+  }
+
+  i = calib->pose.cols() - 1;
+  if (i >= 0 && calib->pose(1, i) < 0) {
+    calib->pose(1, i) = calib->nkept - 1;
+    calib->pose(3, i) = mk_calibration_close(calib);
+  }
+  if (!calib->chunk.back().n) calib->chunk.pop_back();
+
+  return s;
+}
+
+
+/* --- mk_calibration_skew ------------------------------------------------- */
+
+/* Cross product matrix: skew(u).v = u x v */
+
+static inline Eigen::Matrix<double, 3, 3>
+mk_calibration_skew(const Eigen::Matrix<double, 3, 1> &u)
+{
+  Eigen::Matrix<double, 3, 3> m;
+
+  m <<
+        0., -u(2),  u(1),
+      u(2),    0., -u(0),
+     -u(1),  u(0),    0.;
+  return m;
+}
+
+
+/* --- mk_calibration_pool ------------------------------------------------- */
+
+/* Worker threads evaluating fn(arg, i) for i in [0, n), shared with the
+ * calling thread. Threads are created once per minimization and reused for
+ * every evaluation of the error function and its jacobian. */
+
+struct mk_calibration_pool {
+  pthread_t *thread;
+  int32_t nthreads;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  uint32_t gen;
+  int32_t busy;
+  bool quit;
+
+  void (*fn)(void *arg, int32_t i);
+  void *arg;
+  int32_t n;
+  std::atomic<int32_t> next;
+};
+
+static void
+mk_calibration_pool_work(mk_calibration_pool *p)
+{
+  int32_t i;
+
+  while((i = p->next.fetch_add(1, std::memory_order_relaxed)) < p->n)
+    p->fn(p->arg, i);
+}
+
+static void *
+mk_calibration_pool_main(void *arg)
+{
+  mk_calibration_pool *p = (mk_calibration_pool *)arg;
+  uint32_t gen = 0;
+
+  pthread_mutex_lock(&p->lock);
+  while(1) {
+    while(p->gen == gen && !p->quit) pthread_cond_wait(&p->start, &p->lock);
+    if (p->quit) break;
+    gen = p->gen;
+    pthread_mutex_unlock(&p->lock);
+
+    mk_calibration_pool_work(p);
+
+    pthread_mutex_lock(&p->lock);
+    if (!--p->busy) pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+/* Start up to n-1 workers, one less than the number of online cpus. The pool
+ * degrades to sequential evaluation if no thread can be created. */
+static void
+mk_calibration_pool_init(mk_calibration_pool *p, int32_t n)
+{
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->gen = 0;
+  p->busy = 0;
+  p->quit = false;
+  p->n = 0;
+
+  if (ncpu > n) ncpu = n;
+  p->nthreads = 0;
+  p->thread = ncpu > 1 ? new pthread_t[ncpu - 1] : NULL;
+  while(p->nthreads < ncpu - 1) {
+    if (pthread_create(&p->thread[p->nthreads], NULL,
+                       mk_calibration_pool_main, p)) {
+      warnx("calibration: using %d threads", p->nthreads + 1);
+      break;
+    }
+    p->nthreads++;
+  }
+}
+
+static void
+mk_calibration_pool_run(mk_calibration_pool *p, int32_t n,
+                        void (*fn)(void *, int32_t), void *arg)
+{
+  p->fn = fn;
+  p->arg = arg;
+  p->n = n;
+  p->next.store(0, std::memory_order_relaxed);
+  if (!p->nthreads) {
+    mk_calibration_pool_work(p);
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->busy = p->nthreads;
+  p->gen++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  mk_calibration_pool_work(p);
+
+  pthread_mutex_lock(&p->lock);
+  while(p->busy) pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
 
-struct mk_calibration_acc_errfunc {
+static void
+mk_calibration_pool_fini(mk_calibration_pool *p)
+{
+  int32_t i;
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  for(i = 0; i < p->nthreads; i++) pthread_join(p->thread[i], NULL);
+  delete[] p->thread;
+
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->lock);
+}
+
+
+/* --- mk_calibration_ellipsoid -------------------------------------------- */
+
+/* Residuals norm² - |S.(x + b)|² and their jacobian for the first n columns
+ * x of X, for the upper triangular S and the bias b parameterized by theta
+ * as in the accelerometer and magnetometer error functions, with t the
+ * parameters vector. These are written as plain loops over contiguous
+ * samples and jacobian columns, with S expanded, so that the compiler can
+ * vectorize them. */
+
+static void
+mk_calibration_ellipsoid(const Eigen::Matrix<double, 3, 3> &S,
+                         const Eigen::Matrix<double, 3, 1> &b, double norm2,
+                         const Eigen::Matrix<double, 3, Eigen::Dynamic> &X,
+                         int32_t n,
+                         Eigen::Matrix<double, Eigen::Dynamic, 1> &L)
+{
+  const double s00 = S(0, 0), s01 = S(0, 1), s02 = S(0, 2);
+  const double s11 = S(1, 1), s12 = S(1, 2), s22 = S(2, 2);
+  const double b0 = b(0), b1 = b(1), b2 = b(2);
+  const double *x = X.data();
+  double *l = L.data();
+  double x0, x1, x2, v0, v1, v2;
+  int32_t i;
+
+  for(i = 0; i < n; i++) {
+    x0 = x[3*i] + b0;
+    x1 = x[3*i + 1] + b1;
+    x2 = x[3*i + 2] + b2;
+
+    v0 = s00 * x0 + s01 * x1 + s02 * x2;
+    v1 = s11 * x1 + s12 * x2;
+    v2 = s22 * x2;
+
+    l[i] = norm2 - (v0 * v0 + v1 * v1 + v2 * v2);
+  }
+}
+
+static void
+mk_calibration_ellipsoid_df(const Eigen::Matrix<double, Eigen::Dynamic, 1> &t,
+                            const Eigen::Matrix<double, 3, 3> &S,
+                            const Eigen::Matrix<double, 3, 1> &b,
+                            const Eigen::Matrix<double, 3, Eigen::Dynamic> &X,
+                            int32_t n, Eigen::Matrix<double, Eigen::Dynamic,
+                            Eigen::Dynamic> &J)
+{
+  const double s00 = S(0, 0), s01 = S(0, 1), s02 = S(0, 2);
+  const double s11 = S(1, 1), s12 = S(1, 2), s22 = S(2, 2);
+  const double b0 = b(0), b1 = b(1), b2 = b(2);
+  const double t0 = t(0), t1 = t(1), t2 = t(2), t4 = t(4), t5 = t(5);
+  const double *x = X.data();
+  double *j0 = J.col(0).data(), *j1 = J.col(1).data(), *j2 = J.col(2).data();
+  double *j3 = J.col(3).data(), *j4 = J.col(4).data(), *j5 = J.col(5).data();
+  double *j6 = J.col(6).data(), *j7 = J.col(7).data(), *j8 = J.col(8).data();
+  double x0, x1, x2, v0, v1, v2;
+  int32_t i;
+
+  for(i = 0; i < n; i++) {
+    x0 = x[3*i] + b0;
+    x1 = x[3*i + 1] + b1;
+    x2 = x[3*i + 2] + b2;
+
+    /* -2.S.x */
+    v0 = -2. * (s00 * x0 + s01 * x1 + s02 * x2);
+    v1 = -2. * (s11 * x1 + s12 * x2);
+    v2 = -2. * s22 * x2;
+
+    j0[i] = t4 * v0 * x1;
+    j1[i] = t5 * v0 * x2;
+    j2[i] = t5 * v1 * x2;
+    j3[i] = v0 * x0;
+    j4[i] = (t0 * v0 + v1) * x1;
+    j5[i] = (t1 * v0 + t2 * v1 + v2) * x2;
+    j6[i] = s00 * v0;
+    j7[i] = s01 * v0 + s11 * v1;
+    j8[i] = s02 * v0 + s12 * v1 + s22 * v2;
+  }
+}
+
+
+/* --- mk_calibration_ellipsoid_errfunc ----------------------------------- */
+
+/* Ellipsoid fit on groups of samples. Each group i is reduced to its mean,
+ * covariance C (column-major) and a weight. For samples x + b of mean m,
+ * the mean of |S.(x + b)|² is |S.m|² + tr(S.C.S'), so the residual of a
+ * group is the mean of the per-sample residuals. */
+
+struct mk_calibration_ellipsoid_errfunc {
   typedef double Scalar;
   enum {
     InputsAtCompileTime = 9,
@@ -237,10 +786,16 @@ struct mk_calibration_acc_errfunc {
   typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> ValueType;
   typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> JacobianType;
 
+  const rotorcraft_calibration_s *calib;
+  double norm2;
+  Eigen::Matrix<double, 3, Eigen::Dynamic> mean;
+  Eigen::Matrix<double, 9, Eigen::Dynamic> cov;
+  Eigen::Matrix<double, 1, Eigen::Dynamic> weight;
+
   int operator()(const InputType &theta, ValueType &L) const {
     Eigen::Matrix<Scalar, 3, 3> S;
     Eigen::Matrix<Scalar, 3, 1> b;
-    int32_t i, j, k;
+    int32_t i;
 
     S <<
       theta(3),  theta(0) * theta(4),  theta(1) * theta(5),
@@ -251,43 +806,106 @@ struct mk_calibration_acc_errfunc {
       theta(7),
       theta(8);
 
-    for(i = k = 0; i < raw_data->still.cols(); i++)
-      for(j = raw_data->still(0, i); j <= raw_data->still(1, i); j++)
-        L(k++) = 9.81*9.81 - (S * (raw_data->acc.col(j) + b)).squaredNorm();
+    if (mk_calibration_cancelled(calib)) return -1;
+    mk_calibration_ellipsoid(S, b, norm2, mean, mean.cols(), L);
+    for(i = 0; i < mean.cols(); i++) {
+      Eigen::Map<const Eigen::Matrix<Scalar, 3, 3> > C(cov.col(i).data());
+
+      L(i) = weight(i) * (L(i) - (S * C).cwiseProduct(S).sum());
+    }
 
     return 0;
   }
 
-  int inputs() const { return InputsAtCompileTime; }
-  int values() const {
-    int32_t i, k;
+  int df(const InputType &theta, JacobianType &J) const {
+    Eigen::Matrix<Scalar, 3, 3> S, G;
+    Eigen::Matrix<Scalar, 3, 1> b;
+    int32_t i;
+
+    S <<
+      theta(3),  theta(0) * theta(4),  theta(1) * theta(5),
+            0.,             theta(4),  theta(2) * theta(5),
+            0.,                   0.,             theta(5);
+    b <<
+      theta(6),
+      theta(7),
+      theta(8);
+
+    if (mk_calibration_cancelled(calib)) return -1;
+    mk_calibration_ellipsoid_df(theta, S, b, mean, mean.cols(), J);
+    for(i = 0; i < mean.cols(); i++) {
+      Eigen::Map<const Eigen::Matrix<Scalar, 3, 3> > C(cov.col(i).data());
+
+      /* d(-tr(S.C.S'))/dS = -2.S.C, mapped to theta */
+      G.noalias() = -2. * S * C;
+      J(i, 0) += G(0, 1) * theta(4);
+      J(i, 1) += G(0, 2) * theta(5);
+      J(i, 2) += G(1, 2) * theta(5);
+      J(i, 3) += G(0, 0);
+      J(i, 4) += G(0, 1) * theta(0) + G(1, 1);
+      J(i, 5) += G(0, 2) * theta(1) + G(1, 2) * theta(2) + G(2, 2);
+
+      J.row(i) *= weight(i);
+    }
 
-    for(i = k = 0; i < raw_data->still.cols(); i++)
-      k += raw_data->still(1, i) - raw_data->still(0, i) + 1;
-    return k;
+    return 0;
   }
+
+  int inputs() const { return InputsAtCompileTime; }
+  int values() const { return mean.cols(); }
 };
 
+
+/* --- mk_calibration_acc -------------------------------------------------- */
+
 int
-mk_calibration_acc(double ascale[9], double abias[3])
+mk_calibration_acc(rotorcraft_calibration_s *calib,
+                   double ascale[9], double abias[3])
 {
-  Eigen::NumericalDiff<mk_calibration_acc_errfunc> errfunc;
-  int32_t i;
+  mk_calibration_ellipsoid_errfunc errfunc;
+  int32_t i, k, n;
+
+  /* compute accelerometer statistics over all static intervals, weighted by
+   * sqrt(n) so that each interval keeps the contribution of its samples */
+  Eigen::Matrix<double, 3, 1> m;
+  Eigen::Matrix<double, 3, 3> C;
+
+  errfunc.mean.resize(Eigen::NoChange, calib->pose.cols());
+  errfunc.cov.resize(Eigen::NoChange, calib->pose.cols());
+  errfunc.weight.resize(Eigen::NoChange, calib->pose.cols());
+  for(i = 0; i < calib->pose.cols(); i++) {
+    n = calib->pose(1, i) - calib->pose(0, i) + 1;
+    m = calib->kept.acc.middleCols(calib->pose(0, i), n)
+      .cast<double>().rowwise().mean();
+
+    C.setZero();
+    for(k = calib->pose(0, i); k <= calib->pose(1, i); k++)
+      C.noalias() += (calib->kept.acc.col(k).cast<double>() - m) *
+                     (calib->kept.acc.col(k).cast<double>() - m).transpose();
+    C /= n;
+
+    errfunc.mean.col(i) = m;
+    errfunc.cov.col(i) = Eigen::Map<Eigen::Matrix<double, 9, 1> >(C.data());
+    errfunc.weight(i) = std::sqrt(n);
+  }
 
   /* compute optimal parameters */
   Eigen::Matrix<double, Eigen::Dynamic, 1> theta(9);
-  Eigen::LevenbergMarquardt<
-    Eigen::NumericalDiff<mk_calibration_acc_errfunc> > lm(errfunc);
+  Eigen::LevenbergMarquardt<mk_calibration_ellipsoid_errfunc> lm(errfunc);
   Eigen::Matrix<double, 3, 3> S1;
   Eigen::Matrix<double, 3, 1> b1;
   int s;
 
+  errfunc.calib = calib;
+  errfunc.norm2 = 9.81*9.81;
+
   theta <<
     0., 0., 0.,
     1., 1., 1.,
     0., 0., 0.;
 
   s = lm.minimize(theta);
+  if (s == Eigen::LevenbergMarquardtSpace::UserAsked) return ECANCELED;
   if (s <= 0) return EINVAL;
   if (s > 3) return ERANGE;
 
@@ -300,9 +918,14 @@ mk_calibration_acc(double ascale[9], double abias[3])
       theta(7),
       theta(8);
 
-  /* apply correction to all raw accelerometer data */
-  for(i = 0; i < raw_data->samples; i++)
-    raw_data->acc.col(i) = S1 * ( raw_data->acc.col(i) + b1 );
+  /* apply correction to kept accelerometer data and chunks sums */
+  for(i = 0; i < calib->nkept; i++)
+    calib->kept.acc.col(i) = (
+      S1 * ( calib->kept.acc.col(i).cast<double>() + b1 )
+      ).cast<mk_calibration_real>();
+  for(mk_calibration_chunk_s &c: calib->chunk)
+    c.acc = S1 * ( c.acc + c.n * b1 );
+  calib->accext = S1 * ( calib->accext.colwise() + b1 );
 
   /* update old scale S0 and bias b0 with new S1 and b1 so that we now read
    * S1.( S0.(a + b0) + b1 ), i.e. S = S1.S0 and b = b0 + S0^-1.b1 */
@@ -328,81 +951,225 @@ struct mk_calibration_gyr_errfunc {
   typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> ValueType;
   typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> JacobianType;
 
+  const rotorcraft_calibration_s *calib;
   Eigen::Matrix<double, 3, Eigen::Dynamic> acc_dir;
+  mk_calibration_pool *pool;
+
+  /* Motion intervals are preintegrated into chunks of consecutive samples.
+   * With a = dt.g the bias corrected samples of a chunk, alpha = sum(a_k)
+   * and beta = sum(a_j x a_k) for j < k, the rotation vector of the chunk
+   * is, to the second order,
+   *   w = S.alpha + 1/2 cof(S).beta
+   * since (S.a) x (S.b) = cof(S).(a x b). The chunk path length bounds the
+   * third order error. The ith interval spans chunks pose(2, i) to
+   * pose(3, i+1). */
+  Eigen::Matrix<double, 3, Eigen::Dynamic> alpha, beta;
+
+  void preintegrate(const Eigen::Matrix<double, 3, 1> &b) {
+    size_t k;
+
+    alpha.resize(Eigen::NoChange, calib->chunk.size());
+    beta.resize(Eigen::NoChange, calib->chunk.size());
+    for(k = 0; k < calib->chunk.size(); k++) {
+      const mk_calibration_chunk_s &c = calib->chunk[k];
+
+      alpha.col(k) = c.alpha + c.t * b;
+      beta.col(k) = c.beta + c.r.cross(b);
+    }
+  }
 
-  int operator()(const InputType &theta, ValueType &L) const {
-    Eigen::Quaternion<double> q(Eigen::Quaternion<double>::Identity());
-    Eigen::Quaternion<double> omega_q;
-    Eigen::Matrix<double, 3, 3> S;
-    Eigen::Matrix<double, 3, 1> w;
-    int32_t i, k;
-    double dt, a;
+  /* Motion intervals are independent: they are evaluated by the pool
+   * threads, each one filling its own 3 rows of L or J. */
+  struct interval_args {
+    const mk_calibration_gyr_errfunc *f;
+    Eigen::Matrix<double, 3, 3> S, C;
+    Eigen::Matrix<double, 9, 9> dS;
+    ValueType *L;
+    JacobianType *J;
+  };
 
-    S <<
+  /* scale matrix S and cofactor matrix C = [s1 x s2, s2 x s0, s0 x s1], with
+   * si the columns of S */
+  static void scale(const InputType &theta, interval_args &args) {
+    args.S <<
                  theta(6),  theta(0) * theta(7),  theta(1) * theta(8),
       theta(2) * theta(6),             theta(7),  theta(3) * theta(8),
       theta(4) * theta(6),  theta(5) * theta(7),             theta(8);
 
-    for(i = 0; i < raw_data->still.cols()-1; i++) {
+    args.C.col(0) = args.S.col(1).cross(args.S.col(2));
+    args.C.col(1) = args.S.col(2).cross(args.S.col(0));
+    args.C.col(2) = args.S.col(0).cross(args.S.col(1));
+  }
+
+  int operator()(const InputType &theta, ValueType &L) const {
+    interval_args args;
+
+    args.f = this;
+    scale(theta, args);
+    args.L = &L;
 
-      /* integrate gyro over the ith motion interval */
-      q = Eigen::Quaternion<double>::Identity();
-      for(k = raw_data->still(0, i); k <= raw_data->still(1, i+1); k++) {
-        dt = raw_data->t(k) - raw_data->t(k-1);
-        w.noalias() = dt * (S * raw_data->gyr.col(k));
-        a = w.norm();
+    mk_calibration_pool_run(pool, calib->pose.cols()-1, value, &args);
+    return mk_calibration_cancelled(calib) ? -1 : 0;
+  }
+
+  static void value(void *arg, int32_t i) {
+    const interval_args *args = (const interval_args *)arg;
+    const mk_calibration_gyr_errfunc *f = args->f;
+    Eigen::Quaternion<double> q(Eigen::Quaternion<double>::Identity());
+    Eigen::Quaternion<double> omega_q;
+    Eigen::Matrix<double, 3, 1> w;
+    int32_t k;
+    double a;
 
-        if (a < 1e-3) {
-          omega_q.w() = 1 - a*a/8 /*std::cos(a/2)*/;
-          omega_q.vec() = - (0.5 - a*a/48 /*std::sin(a/2)/a*/) * w;
-        } else {
-          omega_q.w() = std::cos(a/2);
-          omega_q.vec() = - std::sin(a/2)/a * w;
-        }
+    if (mk_calibration_cancelled(f->calib)) return;
 
-        q = omega_q * q;
+    /* integrate gyro over the ith motion interval */
+    for(k = f->calib->pose(2, i); k <= f->calib->pose(3, i+1); k++) {
+      w.noalias() = args->S * f->alpha.col(k);
+      w.noalias() += 0.5 * args->C * f->beta.col(k);
+      a = w.norm();
+
+      if (a < 1e-3) {
+        omega_q.w() = 1 - a*a/8 /*std::cos(a/2)*/;
+        omega_q.vec() = - (0.5 - a*a/48 /*std::sin(a/2)/a*/) * w;
+      } else {
+        omega_q.w() = std::cos(a/2);
+        omega_q.vec() = - std::sin(a/2)/a * w;
       }
 
-      /* compute ith error */
-      L.block<3, 1>(3*i, 0) =
-        acc_dir.col(i+1) - q._transformVector(acc_dir.col(i));
+      q = omega_q * q;
     }
 
-    return 0;
+    /* compute ith error */
+    args->L->block<3, 1>(3*i, 0) =
+      f->acc_dir.col(i+1) - q._transformVector(f->acc_dir.col(i));
+  }
+
+  /* The rotation R integrated over each motion interval is perturbed on the
+   * left by exp(dphi). With Rk the rotation integrated up to chunk k and
+   * Jl the left jacobian of the kth increment, by -wk,
+   *   dphi = - R . sum(Rk' . Jl . dwk)
+   * and the sum is accumulated as a function of the entries of S, row-major,
+   * then mapped to theta. */
+  int df(const InputType &theta, JacobianType &J) const {
+    interval_args args;
+
+    args.f = this;
+    scale(theta, args);
+    args.J = &J;
+
+    /* dS/dtheta */
+    args.dS.setZero();
+    args.dS(0, 6) = 1.;
+    args.dS(1, 0) = theta(7);  args.dS(1, 7) = theta(0);
+    args.dS(2, 1) = theta(8);  args.dS(2, 8) = theta(1);
+    args.dS(3, 2) = theta(6);  args.dS(3, 6) = theta(2);
+    args.dS(4, 7) = 1.;
+    args.dS(5, 3) = theta(8);  args.dS(5, 8) = theta(3);
+    args.dS(6, 4) = theta(6);  args.dS(6, 6) = theta(4);
+    args.dS(7, 5) = theta(7);  args.dS(7, 7) = theta(5);
+    args.dS(8, 8) = 1.;
+
+    mk_calibration_pool_run(pool, calib->pose.cols()-1, jacobian, &args);
+    return mk_calibration_cancelled(calib) ? -1 : 0;
+  }
+
+  static void jacobian(void *arg, int32_t i) {
+    const interval_args *args = (const interval_args *)arg;
+    const mk_calibration_gyr_errfunc *f = args->f;
+    const Eigen::Matrix<double, 3, 3> &S = args->S;
+    Eigen::Quaternion<double> q(Eigen::Quaternion<double>::Identity());
+    Eigen::Quaternion<double> omega_q;
+    Eigen::Matrix<double, 3, 9> dphi;
+    Eigen::Matrix<double, 3, 3> Jl, B, D, c;
+    Eigen::Matrix<double, 3, 1> w, al, be;
+    int32_t k, m, n;
+    double a, c1, c2;
+
+    if (mk_calibration_cancelled(f->calib)) return;
+
+    /* integrate gyro and the rotation derivative over the ith motion
+     * interval */
+    dphi.setZero();
+    for(k = f->calib->pose(2, i); k <= f->calib->pose(3, i+1); k++) {
+      al = f->alpha.col(k);
+      be = f->beta.col(k);
+      w.noalias() = S * al;
+      w.noalias() += 0.5 * args->C * be;
+      a = w.norm();
+
+      /* omega_q is the rotation by -w, with left jacobian
+       * Jl = I - c1.[w]x + c2.[w]x² = (1 - c2.a²).I - c1.[w]x + c2.w.w' */
+      if (a < 1e-3) {
+        omega_q.w() = 1 - a*a/8;
+        omega_q.vec() = - (0.5 - a*a/48) * w;
+        c1 = 0.5 - a*a/24;
+        c2 = 1./6. - a*a/120;
+      } else {
+        omega_q.w() = std::cos(a/2);
+        omega_q.vec() = - std::sin(a/2)/a * w;
+        c1 = (1 - std::cos(a))/(a*a);
+        c2 = (a - std::sin(a))/(a*a*a);
+      }
+      Jl.noalias() = (c2 * w) * w.transpose();
+      Jl.diagonal().array() += 1 - c2*a*a;
+      Jl(0, 1) += c1 * w(2);  Jl(0, 2) -= c1 * w(1);
+      Jl(1, 0) -= c1 * w(2);  Jl(1, 2) += c1 * w(0);
+      Jl(2, 0) += c1 * w(1);  Jl(2, 1) -= c1 * w(0);
+
+      q = omega_q * q;
+
+      /* dw/dS(m, n) = D.e_m, with D = alpha(n).I + 1/2 [c_n]x and c_n the
+       * derivative of the cofactor term w.r.t. the nth column of S */
+      c.col(0) = be(1) * S.col(2) - be(2) * S.col(1);
+      c.col(1) = be(2) * S.col(0) - be(0) * S.col(2);
+      c.col(2) = be(0) * S.col(1) - be(1) * S.col(0);
+
+      B.noalias() = q.toRotationMatrix().transpose() * Jl;
+      for(n = 0; n < 3; n++) {
+        D = 0.5 * mk_calibration_skew(c.col(n));
+        D.diagonal().array() += al(n);
+
+        D = B * D;
+        for(m = 0; m < 3; m++)
+          dphi.col(3*m + n) -= D.col(m);
+      }
+    }
+    dphi = q.toRotationMatrix() * dphi;
+
+    /* d(-q.v) = [q.v]x.dphi, with v the ith acceleration direction */
+    args->J->block<3, 9>(3*i, 0).noalias() =
+      mk_calibration_skew(q._transformVector(f->acc_dir.col(i))) *
+      dphi * args->dS;
   }
 
   int inputs() const { return InputsAtCompileTime; }
-  int values() const { return 3 * (raw_data->still.cols() - 1); }
+  int values() const { return 3 * (calib->pose.cols() - 1); }
 };
 
 int
-mk_calibration_gyr(double gscale[9], double gbias[3])
+mk_calibration_gyr(rotorcraft_calibration_s *calib,
+                   double gscale[9], double gbias[3])
 {
-  Eigen::NumericalDiff<mk_calibration_gyr_errfunc> errfunc;
-  int32_t i, k, n;
+  mk_calibration_gyr_errfunc errfunc;
+  int32_t i, k;
 
   /* average gyroscope data over all still periods to get bias */
   Eigen::Matrix<double, 3, 1> b1;
   b1 << 0., 0., 0.;
-  n = 0;
-  for(i = 0; i < raw_data->still.cols(); i++) {
-    for(k = raw_data->still(0, i); k <= raw_data->still(1, i); k++)
-      b1 -= raw_data->gyr.col(k);
-    n += raw_data->still(1, i) - raw_data->still(0, i) + 1;
-  }
-  b1 /= n;
-
-  /* apply bias correction to all raw gyro data */
-  raw_data->gyr.colwise() += b1;
+  for(k = 0; k < calib->nkept; k++)
+    b1 -= calib->kept.gyr.col(k).cast<double>();
+  b1 /= calib->nkept;
 
   /* compute gravity direction over all static intervals */
   Eigen::Matrix<double, 3, 1> g;
 
-  errfunc.acc_dir.resize(Eigen::NoChange, raw_data->still.cols());
-  for(i = 0; i < raw_data->still.cols(); i++) {
+  errfunc.calib = calib;
+  errfunc.acc_dir.resize(Eigen::NoChange, calib->pose.cols());
+  for(i = 0; i < calib->pose.cols(); i++) {
     g << 0., 0., 0.;
-    for(k = raw_data->still(0, i); k <= raw_data->still(1, i); k++)
-      g += raw_data->acc.col(k);
+    for(k = calib->pose(0, i); k <= calib->pose(1, i); k++)
+      g += calib->kept.acc.col(k).cast<double>();
     g.normalize();
 
     errfunc.acc_dir.col(i) = g;
@@ -410,27 +1177,40 @@ mk_calibration_gyr(double gscale[9], double gbias[3])
 
   /* compute optimal parameters */
   Eigen::Matrix<double, Eigen::Dynamic, 1> theta(9);
-  Eigen::LevenbergMarquardt<
-    Eigen::NumericalDiff<mk_calibration_gyr_errfunc> > lm(errfunc);
+  Eigen::LevenbergMarquardt<mk_calibration_gyr_errfunc> lm(errfunc);
   int s;
 
   theta <<
     0., 0., 0., 0., 0., 0.,
     1., 1., 1.;
 
+  /* apply bias correction to the preintegrated chunks */
+  errfunc.preintegrate(b1);
+
+  mk_calibration_pool pool;
+  mk_calibration_pool_init(&pool, calib->pose.cols()-1);
+  errfunc.pool = &pool;
+
   s = lm.minimize(theta);
+  mk_calibration_pool_fini(&pool);
+  if (s == Eigen::LevenbergMarquardtSpace::UserAsked) return ECANCELED;
   if (s <= 0) return EINVAL;
   if (s > 3) return ERANGE;
 
-  /* apply correction to all raw gyroscope data */
+  /* apply correction to kept gyroscope data and chunks sums */
   Eigen::Matrix<double, 3, 3> S1;
   S1 <<
                theta(6),  theta(0) * theta(7),  theta(1) * theta(8),
     theta(2) * theta(6),             theta(7),  theta(3) * theta(8),
     theta(4) * theta(6),  theta(5) * theta(7),             theta(8);
 
-  for(i = 0; i < raw_data->samples; i++)
-    raw_data->gyr.col(i) = S1 * raw_data->gyr.col(i);
+  for(i = 0; i < calib->nkept; i++)
+    calib->kept.gyr.col(i) = (
+      S1 * ( calib->kept.gyr.col(i).cast<double>() + b1 )
+      ).cast<mk_calibration_real>();
+  for(mk_calibration_chunk_s &c: calib->chunk)
+    c.gyr = S1 * ( c.gyr + c.n * b1 );
+  calib->gyrext = S1 * ( calib->gyrext.colwise() + b1 );
 
   /* update old scale S0 and bias b0 with new S1 and b1 so that we now read
    * S1.( S0.(a + b0) + b1 ), i.e. S = S1.S0 and b = b0 + S0^-1.b1 */
@@ -446,63 +1226,83 @@ mk_calibration_gyr(double gscale[9], double gbias[3])
 
 /* --- mk_calibration_mag -------------------------------------------------- */
 
-struct mk_calibration_mag_errfunc {
-  typedef double Scalar;
-  enum {
-    InputsAtCompileTime = 9,
-    ValuesAtCompileTime = Eigen::Dynamic
-  };
-  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> InputType;
-  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> ValueType;
-  typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> JacobianType;
-
-  double norm2;
-
-  int operator()(const InputType &theta, ValueType &L) const {
-    Eigen::Matrix<Scalar, 3, 3> S;
-    Eigen::Matrix<Scalar, 3, 1> b;
-    int32_t i;
-
-    S <<
-      theta(3),  theta(0) * theta(4),  theta(1) * theta(5),
-            0.,             theta(4),  theta(2) * theta(5),
-            0.,                   0.,             theta(5);
-    b <<
-      theta(6),
-      theta(7),
-      theta(8);
-
-    for(i = 0; i < raw_data->samples; i++)
-      L(i) = norm2 - (S * (raw_data->mag.col(i) + b)).squaredNorm();
-
-    return 0;
-  }
-
-  int inputs() const { return InputsAtCompileTime; }
-  int values() const { return raw_data->samples; }
-};
+/* Chunks are binned by the direction of their mean from the initial center
+ * of the fit, on the faces of a cube split in mk_calibration_bins² cells
+ * each. Neighbouring samples are nearly identical, so each cell is reduced to
+ * one residual weighted by sqrt(n), n being its number of samples, and the
+ * fit size does not depend on the duration of the session anymore. */
 
 int
-mk_calibration_mag(double mscale[9], double mbias[3])
+mk_calibration_mag(rotorcraft_calibration_s *calib,
+                   double mscale[9], double mbias[3])
 {
-  Eigen::NumericalDiff<mk_calibration_mag_errfunc> errfunc;
+  const int32_t nbins = 6 * mk_calibration_bins * mk_calibration_bins;
+  mk_calibration_ellipsoid_errfunc errfunc;
   Eigen::Matrix<double, 3, 1> max, min;
   double norm;
 
   /* get expected norm by computing simple min/max average */
-  max = raw_data->mag.leftCols(raw_data->samples).rowwise().maxCoeff();
-  min = raw_data->mag.leftCols(raw_data->samples).rowwise().minCoeff();
+  max = calib->magmax;
+  min = calib->magmin;
   norm = (max - min).mean()/2;
 
+  /* sum chunks by direction */
+  Eigen::Array<int32_t, 1, Eigen::Dynamic> count(nbins);
+  Eigen::Matrix<double, 3, Eigen::Dynamic> sum(3, nbins);
+  Eigen::Matrix<double, 9, Eigen::Dynamic> sumsq(9, nbins);
+  Eigen::Matrix<double, 3, 1> d, m;
+  Eigen::Matrix<double, 3, 3> C;
+  int32_t i, j, k, u, v;
+
+  count.setZero();
+  sum.setZero();
+  sumsq.setZero();
+  for(const mk_calibration_chunk_s &c: calib->chunk) {
+    d = (2 * c.mag / c.n - max - min).cwiseQuotient(max - min);
+    d.cwiseAbs().maxCoeff(&k);
+    if (!(std::fabs(d(k)) > 0.)) continue;
+
+    u = (d((k+1)%3)/std::fabs(d(k)) + 1) / 2 * mk_calibration_bins;
+    v = (d((k+2)%3)/std::fabs(d(k)) + 1) / 2 * mk_calibration_bins;
+    if (u >= mk_calibration_bins) u = mk_calibration_bins - 1;
+    if (v >= mk_calibration_bins) v = mk_calibration_bins - 1;
+
+    j = (2*k + (d(k) < 0.)) * mk_calibration_bins + u;
+    j = j * mk_calibration_bins + v;
+    count(j) += c.n;
+    sum.col(j) += c.mag;
+    sumsq.col(j) += Eigen::Map<const Eigen::Matrix<double, 9, 1> >(
+      c.magsq.data());
+  }
+
+  /* mean and covariance of the samples in each non-empty bin */
+  for(j = k = 0; j < nbins; j++) if (count(j)) k++;
+  errfunc.mean.resize(Eigen::NoChange, k);
+  errfunc.cov.resize(Eigen::NoChange, k);
+  errfunc.weight.resize(Eigen::NoChange, k);
+
+  for(i = j = 0; j < nbins; j++) {
+    if (!count(j)) continue;
+
+    m = sum.col(j) / count(j);
+    C = Eigen::Map<Eigen::Matrix<double, 3, 3> >(sumsq.col(j).data()) /
+      count(j);
+    C.noalias() -= m * m.transpose();
+
+    errfunc.mean.col(i) = m;
+    errfunc.cov.col(i) = Eigen::Map<Eigen::Matrix<double, 9, 1> >(C.data());
+    errfunc.weight(i) = std::sqrt(count(j));
+    i++;
+  }
+
   /* fit a sphere with computed norm */
   Eigen::Matrix<double, Eigen::Dynamic, 1> theta(9);
-  Eigen::LevenbergMarquardt<
-    Eigen::NumericalDiff<mk_calibration_mag_errfunc> > lm(errfunc);
+  Eigen::LevenbergMarquardt<mk_calibration_ellipsoid_errfunc> lm(errfunc);
   Eigen::Matrix<double, 3, 3> S1;
   Eigen::Matrix<double, 3, 1> b1;
-  int32_t i;
   int s;
 
+  errfunc.calib = calib;
   errfunc.norm2 = norm * norm;
 
   theta <<
@@ -511,6 +1311,7 @@ mk_calibration_mag(double mscale[9], double mbias[3])
     - (max + min) / 2;
 
   s = lm.minimize(theta);
+  if (s == Eigen::LevenbergMarquardtSpace::UserAsked) return ECANCELED;
   if (s <= 0) return EINVAL;
   if (s > 3) return ERANGE;
 
@@ -523,9 +1324,13 @@ mk_calibration_mag(double mscale[9], double mbias[3])
       theta(7),
       theta(8);
 
-  /* apply correction to raw data */
-  for(i = 0; i < raw_data->samples; i++)
-    raw_data->mag.col(i) = S1 * ( raw_data->mag.col(i) + b1 );
+  /* apply correction to kept data and chunks sums */
+  for(i = 0; i < calib->nkept; i++)
+    calib->kept.mag.col(i) = (
+      S1 * ( calib->kept.mag.col(i).cast<double>() + b1 )
+      ).cast<mk_calibration_real>();
+  for(mk_calibration_chunk_s &c: calib->chunk)
+    c.mag = S1 * ( c.mag + c.n * b1 );
 
   /* update old scale S0 and bias b0 with new S1 and b1 so that we now read
    * S1.( S0.(a + b0) + b1 ), i.e. S = S1.S0 and b = b0 + S0^-1.b1 */
@@ -541,10 +1346,13 @@ mk_calibration_mag(double mscale[9], double mbias[3])
 
 /* --- mk_calibration_fini ------------------------------------------------- */
 
-void
-mk_calibration_fini(double stddeva[3], double stddevw[3], double stddevm[3],
-                    double maxa[3], double maxw[3],
-                    double *avgtemp, double *avga, double *avgw)
+/* Statistics of the collected data, with the current calibration applied */
+
+static void
+mk_calibration_stats(const rotorcraft_calibration_s *calib,
+                     double stddeva[3], double stddevw[3], double stddevm[3],
+                     double maxa[3], double maxw[3],
+                     double *avgtemp, double *avga, double *avgw)
 {
   Eigen::Array<double, 3, 1> sum, sumsq, s, v;
   int32_t i, k, n, l;
@@ -555,16 +1363,16 @@ mk_calibration_fini(double stddeva[3], double stddevw[3], double stddevm[3],
     s << 0., 0., 0.;
     avg = 0;
     n = 0;
-    for(i = 0; i < raw_data->still.cols(); i++) {
+    for(i = 0; i < calib->pose.cols(); i++) {
       sum << 0., 0., 0.;
       sumsq << 0., 0., 0.;
-      for(k = raw_data->still(0, i); k <= raw_data->still(1, i); k++) {
-        v = raw_data->acc.col(k);
+      for(k = calib->pose(0, i); k <= calib->pose(1, i); k++) {
+        v = calib->kept.acc.col(k).cast<double>();
         sum += v;
         sumsq += v * v;
         avg += v.matrix().norm();
       }
-      l = raw_data->still(1, i) - raw_data->still(0, i) + 1;
+      l = calib->pose(1, i) - calib->pose(0, i) + 1;
       s += sumsq - sum * sum / l;
       n += l;
     }
@@ -581,15 +1389,12 @@ mk_calibration_fini(double stddeva[3], double stddevw[3], double stddevm[3],
     sum << 0., 0., 0.;
     sumsq << 0., 0., 0.;
     avg = 0;
-    n = 0;
-    for(i = 0; i < raw_data->still.cols(); i++) {
-      for(k = raw_data->still(0, i); k <= raw_data->still(1, i); k++) {
-        v = raw_data->gyr.col(k);
-        sum += v;
-        sumsq += v * v;
-        avg += v.matrix().norm();
-      }
-      n += raw_data->still(1, i) - raw_data->still(0, i) + 1;
+    n = calib->nkept;
+    for(k = 0; k < n; k++) {
+      v = calib->kept.gyr.col(k).cast<double>();
+      sum += v;
+      sumsq += v * v;
+      avg += v.matrix().norm();
     }
     s = (sumsq - sum * sum/n)/n;
     s = s.max(0.);
@@ -603,15 +1408,15 @@ mk_calibration_fini(double stddeva[3], double stddevw[3], double stddevm[3],
   if (stddevm) {
     s << 0., 0., 0.;
     n = 0;
-    for(i = 0; i < raw_data->still.cols(); i++) {
+    for(i = 0; i < calib->pose.cols(); i++) {
       sum << 0., 0., 0.;
       sumsq << 0., 0., 0.;
-      for(k = raw_data->still(0, i); k <= raw_data->still(1, i); k++) {
-        v = raw_data->mag.col(k);
+      for(k = calib->pose(0, i); k <= calib->pose(1, i); k++) {
+        v = calib->kept.mag.col(k).cast<double>();
         sum += v;
         sumsq += v * v;
       }
-      l = raw_data->still(1, i) - raw_data->still(0, i) + 1;
+      l = calib->pose(1, i) - calib->pose(0, i) + 1;
       s += sumsq - sum * sum / l;
       n += l;
     }
@@ -622,65 +1427,301 @@ mk_calibration_fini(double stddeva[3], double stddevw[3], double stddevm[3],
     stddevm[2] = std::sqrt(s(2));
   }
 
-  /* max absolute */
+  /* max absolute, over still samples and the extreme samples */
   if (maxa) {
     Eigen::Map<Eigen::Array3d> m(maxa);
-    m = raw_data->acc.cwiseAbs().rowwise().maxCoeff();
+    m = calib->accext.cwiseAbs().rowwise().maxCoeff();
+    if (calib->nkept)
+      m = m.max(calib->kept.acc.leftCols(calib->nkept).cwiseAbs()
+                .rowwise().maxCoeff().cast<double>().array());
   }
   if (maxw) {
     Eigen::Map<Eigen::Array3d> m(maxw);
-    m = raw_data->gyr.cwiseAbs().rowwise().maxCoeff();
+    m = calib->gyrext.cwiseAbs().rowwise().maxCoeff();
+    if (calib->nkept)
+      m = m.max(calib->kept.gyr.leftCols(calib->nkept).cwiseAbs()
+                .rowwise().maxCoeff().cast<double>().array());
   }
 
   /* average temp */
   if (avgtemp)
-    *avgtemp = raw_data->temp.leftCols(raw_data->samples).mean();
+    *avgtemp = calib->sumtemp / calib->flushed;
+}
+
+void
+mk_calibration_fini(rotorcraft_calibration_s **calibration,
+                    double stddeva[3], double stddevw[3], double stddevm[3],
+                    double maxa[3], double maxw[3],
+                    double *avgtemp, double *avga, double *avgw)
+{
+  if (!*calibration) return;
 
-  if (raw_data) delete raw_data;
+  mk_calibration_stats(*calibration, stddeva, stddevw, stddevm,
+                       maxa, maxw, avgtemp, avga, avgw);
+
+  delete *calibration;
+  *calibration = NULL;
 }
 
 
 /* --- mk_calibration_log -------------------------------------------------- */
 
 void
-mk_calibration_log(const char *path)
+mk_calibration_log(const rotorcraft_calibration_s *calib, const char *path)
 {
   FILE *f = fopen(path, "w");
-  int i, j;
-  int still;
+  int i, j, k;
 
   if (!f) { warn("%s", path); return; }
   fprintf(f, "still imu_temp  "
           "imu_ax imu_ay imu_az  imu_wx imu_wy imu_wz  mag_x mag_y mag_z  "
           "moq_ax moq_ay moq_az  moq_wx moq_wy moq_wz\n");
 
-  still = 0;
-  for(i = j = 0; i < raw_data->samples; i++) {
-    /* check if current sample is within a still interval */
-    if (j < raw_data->still.cols()) {
-      if (i < raw_data->still(0, j))
-        still = 0;
-      else if (i <= raw_data->still(1, j))
-        still = 1;
-      else {
-        still = 0;
-        j++;
-      }
+  for(i = j = 0;
+      i < (int)calib->chunk.size() && !mk_calibration_cancelled(calib); i++) {
+    /* still intervals are logged sample by sample */
+    if (j < calib->pose.cols() && i == calib->pose(2, j)) {
+      const mk_calibration_samples &p = calib->kept;
+
+      for(k = calib->pose(0, j); k <= calib->pose(1, j); k++)
+        fprintf(f, "1 %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g\n",
+                p.temp(k),
+                p.acc(0, k), p.acc(1, k), p.acc(2, k),
+                p.gyr(0, k), p.gyr(1, k), p.gyr(2, k),
+                p.mag(0, k), p.mag(1, k), p.mag(2, k),
+                p.moq(0, k), p.moq(1, k), p.moq(2, k),
+                p.moq(3, k), p.moq(4, k), p.moq(5, k));
+
+      i = calib->pose(3, j++);
+      continue;
     }
 
-    fprintf(f, "%d %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g\n",
-            still, raw_data->temp(i),
-            raw_data->acc(0, i), raw_data->acc(1, i), raw_data->acc(2, i),
-            raw_data->gyr(0, i), raw_data->gyr(1, i), raw_data->gyr(2, i),
-            raw_data->mag(0, i), raw_data->mag(1, i), raw_data->mag(2, i),
-            raw_data->moq(0, i), raw_data->moq(1, i), raw_data->moq(2, i),
-            raw_data->moq(3, i), raw_data->moq(4, i), raw_data->moq(5, i));
+    /* motion is logged as the mean of each chunk */
+    const mk_calibration_chunk_s &c = calib->chunk[i];
+
+    fprintf(f, "0 %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g\n",
+            c.temp / c.n,
+            c.acc(0) / c.n, c.acc(1) / c.n, c.acc(2) / c.n,
+            c.gyr(0) / c.n, c.gyr(1) / c.n, c.gyr(2) / c.n,
+            c.mag(0) / c.n, c.mag(1) / c.n, c.mag(2) / c.n,
+            c.moq(0) / c.n, c.moq(1) / c.n, c.moq(2) / c.n,
+            c.moq(3) / c.n, c.moq(4) / c.n, c.moq(5) / c.n);
   }
 
   fclose(f);
 }
 
 
+/* --- mk_calibration_release ---------------------------------------------- */
+
+/* Free the samples storage once solved. This is done by the solver thread,
+ * so that releasing the context from the main task does not unmap large
+ * blocks of memory there. */
+
+static void
+mk_calibration_release(rotorcraft_calibration_s *calib)
+{
+  mk_calibration_reserve(calib->ring, 0);
+  mk_calibration_reserve(calib->kept, 0);
+  calib->dt.resize(0);
+  calib->nkept = calib->capacity = 0;
+
+  std::vector<mk_calibration_chunk_s,
+              Eigen::aligned_allocator<mk_calibration_chunk_s> >().swap(
+                calib->chunk);
+  calib->pose.resize(Eigen::NoChange, 0);
+  calib->still.resize(Eigen::NoChange, 0);
+}
+
+
+/* --- mk_calibration_solve ------------------------------------------------ */
+
+/* Run the accelerometer and gyroscope (imu) and/or magnetometer (mag)
+ * calibrations in a separate thread, on a copy of the current calibration
+ * cal, then write the log and compute the statistics of the collected
+ * data. The main task polls mk_calibration_result() meanwhile. */
+
+static void *
+mk_calibration_solve_main(void *arg)
+{
+  mk_calibration_solver *w = (mk_calibration_solver *)arg;
+  rotorcraft_calibration_s *calib = w->calib;
+  rotorcraft_ids_imu_calibration_s *cal = &w->cal;
+
+  w->s = 0;
+  if (w->imu) {
+    w->s = mk_calibration_acc(calib, cal->ascale, cal->abias);
+    if (w->s) {
+      if (w->s != ECANCELED) warnx("accelerometer calibration failed");
+      goto fail;
+    }
+
+    w->s = mk_calibration_gyr(calib, cal->gscale, cal->gbias);
+    if (w->s) {
+      if (w->s != ECANCELED) warnx("gyroscope calibration failed");
+      goto fail;
+    }
+  }
+
+  if (w->mag) {
+    w->s = mk_calibration_mag(calib, cal->mscale, cal->mbias);
+    if (w->s) {
+      if (w->s != ECANCELED) warnx("magnetometer calibration failed");
+      goto fail;
+    }
+  }
+
+  if (*w->path) mk_calibration_log(calib, w->path);
+
+  if (w->imu)
+    mk_calibration_stats(
+      calib, cal->astddev, cal->gstddev, w->mag ? cal->mstddev : NULL,
+      w->maxa, w->maxw, &cal->temp, &w->avga, &w->avgw);
+  else
+    mk_calibration_stats(
+      calib, NULL, NULL, cal->mstddev, NULL, NULL, NULL, NULL, NULL);
+
+  mk_calibration_release(calib);
+  w->done.store(true, std::memory_order_release);
+  return NULL;
+
+fail:
+  if (*w->path && w->s != ECANCELED) mk_calibration_log(calib, w->path);
+
+  mk_calibration_release(calib);
+  w->done.store(true, std::memory_order_release);
+  return NULL;
+}
+
+int
+mk_calibration_solve(rotorcraft_calibration_s *calib,
+                     const char *path, bool imu, bool mag,
+                     const rotorcraft_ids_imu_calibration_s *cal)
+{
+  mk_calibration_solver *solver;
+  struct sched_param sp;
+  pthread_attr_t attr;
+  int s;
+
+  if (!calib) return EINVAL;
+  if (calib->solver) return EBUSY;
+
+  solver = new(mk_calibration_solver);
+  if (!solver) return ENOMEM;
+
+  solver->calib = calib;
+  solver->done = false;
+  solver->cancel = false;
+  solver->imu = imu;
+  solver->mag = mag;
+  snprintf(solver->path, sizeof(solver->path), "%s", path);
+  solver->cal = *cal;
+
+  /* do not compete with the real-time task that started the solver */
+  sp.sched_priority = 0;
+  s = pthread_attr_init(&attr);
+  if (s) goto fail;
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+  pthread_attr_setschedparam(&attr, &sp);
+
+  calib->solver = solver;
+  s = pthread_create(&solver->thread, &attr, mk_calibration_solve_main, solver);
+  pthread_attr_destroy(&attr);
+  if (s) goto fail;
+
+  return 0;
+
+fail:
+  delete solver;
+  calib->solver = NULL;
+  return s;
+}
+
+
+/* --- mk_calibration_result ----------------------------------------------- */
+
+/* Return EAGAIN while the solver is running, or its status. On success, the
+ * parameters that were calibrated are updated in cal, as well as the
+ * statistics of the accelerometer and gyroscope data if not NULL. Once the
+ * solver is done, the calibration context is released. */
+
+int
+mk_calibration_result(rotorcraft_calibration_s **calibration,
+                      rotorcraft_ids_imu_calibration_s *cal,
+                      double maxa[3], double maxw[3],
+                      double *avga, double *avgw)
+{
+  mk_calibration_solver *w;
+  int s;
+
+  if (!*calibration) return EINVAL;
+  w = (*calibration)->solver;
+  if (!w) return EINVAL;
+  if (!w->done.load(std::memory_order_acquire)) return EAGAIN;
+
+  pthread_join(w->thread, NULL);
+  s = w->s;
+  if (!s) {
+    if (w->imu) {
+      memcpy(cal->gscale, w->cal.gscale, sizeof(cal->gscale));
+      memcpy(cal->gbias, w->cal.gbias, sizeof(cal->gbias));
+      memcpy(cal->gstddev, w->cal.gstddev, sizeof(cal->gstddev));
+      memcpy(cal->ascale, w->cal.ascale, sizeof(cal->ascale));
+      memcpy(cal->abias, w->cal.abias, sizeof(cal->abias));
+      memcpy(cal->astddev, w->cal.astddev, sizeof(cal->astddev));
+      cal->temp = w->cal.temp;
+
+      if (maxa) memcpy(maxa, w->maxa, sizeof(w->maxa));
+      if (maxw) memcpy(maxw, w->maxw, sizeof(w->maxw));
+      if (avga) *avga = w->avga;
+      if (avgw) *avgw = w->avgw;
+    }
+    if (w->mag) {
+      memcpy(cal->mscale, w->cal.mscale, sizeof(cal->mscale));
+      memcpy(cal->mbias, w->cal.mbias, sizeof(cal->mbias));
+      memcpy(cal->mstddev, w->cal.mstddev, sizeof(cal->mstddev));
+    }
+  }
+
+  delete w;
+  (*calibration)->solver = NULL;
+  mk_calibration_fini(
+    calibration, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  return s;
+}
+
+
+/* --- mk_calibration_cancel ----------------------------------------------- */
+
+/* Ask the solver to stop if running, and release the calibration context
+ * once it has. Returns EAGAIN without waiting while the solver completes
+ * the current evaluation of the error function or the log, so that the
+ * caller can poll again later, and 0 once the context is released. */
+
+int
+mk_calibration_cancel(rotorcraft_calibration_s **calibration)
+{
+  mk_calibration_solver *w;
+
+  if (!*calibration) return 0;
+
+  w = (*calibration)->solver;
+  if (w) {
+    w->cancel.store(true, std::memory_order_relaxed);
+    if (!w->done.load(std::memory_order_acquire)) return EAGAIN;
+
+    pthread_join(w->thread, NULL);
+    delete w;
+    (*calibration)->solver = NULL;
+  }
+
+  mk_calibration_fini(
+    calibration, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+  return 0;
+}
+
+
 /* --- mk_calibration_rotate ----------------------------------------------- */
 
 void
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include "acrotorcraft.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rotorcraft_c_types.h"
+#include "codels.h"
+#include "ring.h"
+
+/* Raw sensor capture: every decoded sensor message is pushed by the comm
+ * task in a lock-free ring, and a writer thread appends the ring contents to
+ * the capture file. */
+
+#define rc_capture_poll	5000000	/* writer polling period, ns */
+
+/* capture record, 32 bytes in host byte order */
+struct rc_capture_rec {
+  uint64_t ts;		/* estimated timestamp, ns */
+  int32_t delay;	/* arrival time - ts, ns */
+  uint8_t type;		/* message type: I, C, M or B */
+  uint8_t seq;		/* message sequence number */
+  uint8_t id;		/* motor id, from 0 */
+  uint8_t state;	/* motor state */
+  int16_t raw[8];	/* raw counts */
+};
+
+struct rc_capture_writer {
+  pthread_t thread;
+  int fd;
+  struct rc_ring ring;
+
+  atomic_bool stop;
+  atomic_int err;
+};
+
+
+/* --- rc_capture_writer_main ---------------------------------------------- */
+
+static void *
+rc_capture_writer_main(void *arg)
+{
+  struct rc_capture_writer *wr = arg;
+  const char *data;
+  uint32_t n;
+  size_t len;
+  ssize_t s;
+  bool stop;
+
+  do {
+    /* read the stop flag first, so that all records pushed before are
+     * written */
+    stop = atomic_load(&wr->stop);
+
+    /* write contiguous ring contents directly */
+    while ((data = rc_ring_rspan(&wr->ring, &n))) {
+      for(len = n * wr->ring.size; len > 0; data += s, len -= s) {
+        s = write(wr->fd, data, len);
+        if (s < 0) {
+          if (errno == EINTR) { s = 0; continue; }
+          goto err;
+        }
+      }
+      rc_ring_popn(&wr->ring, n);
+    }
+
+    if (!stop)
+      nanosleep(&(struct timespec){ .tv_nsec = rc_capture_poll }, NULL);
+  } while (!stop);
+
+  return NULL;
+err:
+  atomic_store(&wr->err, errno);
+  return NULL;
+}
+
+
+/* --- rc_capture_msg ------------------------------------------------------ */
+
+/* Capture a sensor message: type and sequence number in msg[0] and msg[1],
+ * big endian 16 bits values starting at msg[off], and the motor state in
+ * msg[2] if off is 3. Must be called from the comm task only. */
+
+void
+rc_capture_msg(rotorcraft_capture_s *capture, const uint8_t *msg,
+               uint8_t len, uint8_t off, uint8_t id, const or_time_ts *ts,
+               struct timeval atv)
+{
+  struct rc_capture_rec *r;
+  int64_t a, t;
+  int i, n;
+
+  if (!capture || !capture->writer) return;
+
+  capture->total++;
+  r = rc_ring_wptr(&capture->writer->ring);
+  if (!r) {
+    capture->missed++;
+    return;
+  }
+
+  a = atv.tv_sec * 1000000000LL + atv.tv_usec * 1000LL;
+  t = ts ? ts->sec * 1000000000LL + ts->nsec : a;
+  r->ts = t;
+  r->delay = a - t > INT32_MAX ? INT32_MAX :
+             a - t < INT32_MIN ? INT32_MIN : a - t;
+  r->type = msg[0];
+  r->seq = msg[1];
+  r->id = id;
+  r->state = off > 2 ? msg[2] : 0;
+
+  n = len > off ? (len - off) / 2 : 0;
+  if (n > 8) n = 8;
+  for(i = 0; i < n; i++)
+    r->raw[i] = (int16_t)((msg[off + 2*i] << 8) | msg[off + 2*i + 1]);
+  for(; i < 8; i++) r->raw[i] = 0;
+
+  rc_ring_push(&capture->writer->ring);
+}
+
+
+/* --- Function capture ------------------------------------------------- */
+
+/** Codel rc_capture_start of function capture.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_sys, rotorcraft_e_range.
+ */
+genom_event
+rc_capture_start(const char path[64], uint32_t queue,
+                 rotorcraft_capture_s **capture, const genom_context self)
+{
+  struct rc_capture_writer *wr;
+  int s;
+
+  if (queue < 2) return rotorcraft_e_range(self);
+
+  /* stop previous capture */
+  rc_capture_stop(capture, self);
+
+  wr = malloc(sizeof(*wr));
+  if (!wr) return mk_e_sys_error("capture", self);
+
+  wr->fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if (wr->fd < 0) {
+    free(wr);
+    return mk_e_sys_error(path, self);
+  }
+
+  s = dprintf(
+    wr->fd,
+    "# raw sensor capture, %s endian, %zu bytes per record\n"
+    "# ts in nanoseconds, arrival time is ts + delay\n"
+    "ts:u64 delay:i32 type:u8 seq:u8 id:u8 state:u8"
+    " raw0:i16 raw1:i16 raw2:i16 raw3:i16 raw4:i16 raw5:i16 raw6:i16"
+    " raw7:i16\n",
+    (union { uint16_t i; uint8_t c[2]; }){ .i = 1 }.c[0] ? "little" : "big",
+    sizeof(struct rc_capture_rec));
+  if (s < 0) goto err;
+
+  if (rc_ring_init(&wr->ring, queue, sizeof(struct rc_capture_rec)))
+    goto err;
+  atomic_init(&wr->stop, false);
+  atomic_init(&wr->err, 0);
+
+  errno = pthread_create(&wr->thread, NULL, rc_capture_writer_main, wr);
+  if (errno) {
+    rc_ring_fini(&wr->ring);
+    goto err;
+  }
+
+  (*capture)->writer = wr;
+  (*capture)->total = (*capture)->missed = 0;
+  return genom_ok;
+
+err:
+  s = errno;
+  close(wr->fd);
+  free(wr);
+  errno = s;
+  return mk_e_sys_error("capture", self);
+}
+
+
+/* --- Function capture_stop -------------------------------------------- */
+
+/** Codel rc_capture_stop of function capture_stop.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+rc_capture_stop(rotorcraft_capture_s **capture, const genom_context self)
+{
+  struct rc_capture_writer *wr;
+  (void)self; /* -Wunused-parameter */
+
+  if (!*capture || !(*capture)->writer) return genom_ok;
+  wr = (*capture)->writer;
+
+  atomic_store(&wr->stop, true);
+  pthread_join(wr->thread, NULL);
+  if (atomic_load(&wr->err)) {
+    errno = atomic_load(&wr->err);
+    warn("capture");
+  }
+  if (close(wr->fd)) warn("capture");
+
+  rc_ring_fini(&wr->ring);
+  free(wr);
+  (*capture)->writer = NULL;
+
+  return genom_ok;
+}
+
+
+/* --- Function capture_info -------------------------------------------- */
+
+/** Codel rc_capture_info of function capture_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+rc_capture_info(const rotorcraft_capture_s *capture, uint32_t *miss,
+                uint32_t *total, const genom_context self)
+{
+  (void)self; /* -Wunused-parameter */
+
+  *miss = *total = 0;
+  if (capture) {
+    *miss = capture->missed;
+    *total = capture->total;
+  }
+  return genom_ok;
+}
@@ -17,34 +17,156 @@
 #ifndef H_ROTORCRAFT_CODELS
 #define H_ROTORCRAFT_CODELS
 
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <aio.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
 
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+#endif
+
 #include "rotorcraft_c_types.h"
 
+/* log header configuration comments, in header order */
+enum rc_log_hdr {
+  RC_LOG_HDR_CAL,	/* imu calibration */
+  RC_LOG_HDR_FILTER,	/* imu filter */
+  RC_LOG_HDR_RATE,	/* sensor rate */
+  RC_LOG_NHDR
+};
+
 struct rotorcraft_log_s {
   int fd;
-  struct aiocb req;
-  char buffer[4096];
-  bool pending, skipped;
+  char path[64];	/* first segment */
+  bool skipped;
   uint32_t decimation;
   size_t missed, total;
 
-# define rc_log_header_fmt                                                     \
-  "ts imu_rate mag_rate motor_rate bat imu_temp "                              \
+  /* asynchronous writes, with io_uring or POSIX aio */
+  struct rc_log_io {
+    int fd;		/* -1 until the header is written */
+    const char *data;	/* write in progress */
+    size_t len;
+    bool pending;
+    off_t written, allocated;	/* file size and preallocation */
+
+    struct aiocb req;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    bool uring, fallocating;
+#endif
+  } io;
+
+  /* ring of buffers: buf[r] is being written, buf[r+1..w-1] are full and
+   * buf[w] is being filled */
+  struct rc_log_buf {
+    char *data;
+    size_t len;
+    struct timeval tv;	/* first entry time */
+  } *buf;
+  uint32_t nbuf, r, w;
+  size_t bufsize;
+  struct {
+    size_t size;
+    uint32_t count;
+    double period;	/* maximum buffering time */
+    off_t prealloc;	/* file preallocation step */
+    off_t rotate_size;	/* segment size, 0 for no rotation */
+    double rotate_period;	/* segment duration, 0 for no rotation */
+  } cfg;
+# define rc_log_maxrec	1024	/* maximum record size */
+
+  bool binary;		/* binary or text format */
+  bool compress;	/* compressed binary format */
+  uint32_t columns;	/* logged rc_log_column groups */
+
+  /* latest configuration comments, repeated in each segment header */
+  char *hdr[RC_LOG_NHDR];
+
+  /* text and compressed formats, or rotated logs writer thread, private to
+   * log.c */
+  struct rc_log_writer *writer;
+
+# define rc_log_header_ts	"ts"
+# define rc_log_header_rate	"imu_rate mag_rate motor_rate"
+# define rc_log_header_bat	"bat"
+# define rc_log_header_imu                                                     \
+  "imu_temp "                                                                  \
   "imu_wx imu_wy imu_wz raw_wx raw_wy raw_wz "                                 \
-  "imu_ax imu_ay imu_az raw_ax raw_ay raw_az "                                 \
-  "mag_x mag_y mag_z raw_mx raw_my raw_mz "                                    \
-  "cmd_v0 cmd_v1 cmd_v2 cmd_v3 cmd_v4 cmd_v5 cmd_v6 cmd_v7 "                   \
-  "meas_v0 meas_v1 meas_v2 meas_v3 meas_v4 meas_v5 meas_v6 meas_v7 "           \
-  "clk0 clk1 clk2 clk3 clk4 clk5 clk6 clk7"
+  "imu_ax imu_ay imu_az raw_ax raw_ay raw_az"
+# define rc_log_header_mag	"mag_x mag_y mag_z raw_mx raw_my raw_mz"
+# define rc_log_header_cmd                                                     \
+  "cmd_v0 cmd_v1 cmd_v2 cmd_v3 cmd_v4 cmd_v5 cmd_v6 cmd_v7"
+# define rc_log_header_meas                                                    \
+  "meas_v0 meas_v1 meas_v2 meas_v3 meas_v4 meas_v5 meas_v6 meas_v7"
+# define rc_log_header_clk	"clk0 clk1 clk2 clk3 clk4 clk5 clk6 clk7"
+
+# define rc_log_header_fmt                                                     \
+  rc_log_header_ts " " rc_log_header_rate " " rc_log_header_bat " "           \
+  rc_log_header_imu " " rc_log_header_mag " " rc_log_header_cmd " "           \
+  rc_log_header_meas " " rc_log_header_clk
+};
+
+/* raw sensor capture */
+struct rotorcraft_capture_s {
+  size_t total, missed;
+
+  /* writer thread, private to capture.c */
+  struct rc_capture_writer *writer;
+};
+
+/* live telemetry stream */
+struct rotorcraft_stream_s {
+  int fd;		/* datagram socket, or -1 */
+  bool active;		/* records are being sent */
+  uint32_t decimation, columns;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  size_t missed, total;
+};
+
+/* log column groups */
+enum rc_log_column {
+  RC_LOG_RATE =	0x01,
+  RC_LOG_BAT =	0x02,
+  RC_LOG_IMU =	0x04,
+  RC_LOG_MAG =	0x08,
+  RC_LOG_CMD =	0x10,
+  RC_LOG_MEAS =	0x20,
+  RC_LOG_CLK =	0x40,
+  RC_LOG_ALL =	0x7f
+};
+
+/* log record: one main task period, fields are valid according to the
+ * presence bitmask */
+struct rc_log_rec {
+  uint64_t sec;
+  uint32_t nsec;
+
+  uint32_t present;
+# define rc_log_has_bat		(1U << 0)
+# define rc_log_has_imu		(1U << 1)
+# define rc_log_has_mag		(1U << 2)
+# define rc_log_has_cmd(i)	(1U << (3 + (i)))
+# define rc_log_has_meas(i)	(1U << (3 + or_rotorcraft_max_rotors + (i)))
+
+  double rate[3];
+  double bat;
+  double imu[13];	/* temp, gyr, raw gyr, acc, raw acc */
+  double mag[6];	/* mag, raw mag */
+  double cmd[or_rotorcraft_max_rotors];
+  double meas[or_rotorcraft_max_rotors];
+  uint8_t clk[or_rotorcraft_max_rotors];
 };
 
 enum rc_device {
@@ -71,11 +193,36 @@ struct mk_channel_s {
   bool start;
   bool escape;
   uint8_t msg[64], len; /* last message */
+
+  struct {
+    char cmd;		/* 'w' or 'q', or 0 if unknown */
+    int16_t p[or_rotorcraft_max_rotors];
+    uint16_t n;
+    struct timeval tv;	/* last transmission */
+  } sp; /* last setpoint sent */
+
+  struct {
+    uint8_t buf[64], len;	/* setpoint waiting for imu data */
+    double phase, jitter;	/* setpoint delay after imu data arrival */
+    uint32_t late;		/* setpoints sent without imu data */
+  } sync;
+
+  double estop;		/* worst case stop message write time */
+};
+
+/* Emergency stop latch. Once a stop message is sent, setpoints are not
+ * transmitted anymore until the next start. */
+struct mk_estop_s {
+  pthread_mutex_t lock;	/* serializes setpoints and stop messages */
+  bool latched;
 };
 
 struct rotorcraft_conn_s {
   struct mk_channel_s *chan;
   uint32_t n;
+
+  struct timeval imu;	/* last imu data arrival */
+  struct mk_estop_s *estop;
 };
 
 static inline genom_event
@@ -100,22 +247,112 @@ int	mk_wait_msg(const rotorcraft_conn_s *conn,
                 const struct timeval *deadline);
 int	mk_recv_msg(struct mk_channel_s *chan, bool block);
 int	mk_send_msg(const struct mk_channel_s *chan, const char *fmt, ...);
+int	mk_defer_msg(struct mk_channel_s *chan, const char *fmt, ...);
+int	mk_flush_msg(const rotorcraft_conn_s *conn, struct mk_channel_s *chan);
+int	mk_write_msg(int fd, const char *buf, size_t len);
+int	mk_estop(const rotorcraft_conn_s *conn, double *latency);
+bool	mk_estop_lock(const rotorcraft_conn_s *conn);
+void	mk_estop_unlock(const rotorcraft_conn_s *conn);
+void	mk_estop_clear(const rotorcraft_conn_s *conn);
+
+int	rc_log_alloc(rotorcraft_log_s *log);
+int	rc_log_io_init(rotorcraft_log_s *log);
+void	rc_log_io_start(rotorcraft_log_s *log);
+void	rc_log_io_fini(rotorcraft_log_s *log);
+int	rc_log_next(rotorcraft_log_s *log);
+int	rc_log_reap(rotorcraft_log_s *log);
+int	rc_log_submit(rotorcraft_log_s *log);
+int	rc_log_sync(rotorcraft_log_s *log);
+int	rc_log_printf(rotorcraft_log_s *log, enum rc_log_hdr hdr,
+                const char *fmt, ...)
+  __attribute__ ((format (printf, 3, 4)));
+struct rc_log_rec *
+	rc_log_writer_slot(rotorcraft_log_s *log);
+void	rc_log_writer_push(rotorcraft_log_s *log);
+int	rc_log_writer_error(rotorcraft_log_s *log);
+
+int	rc_log_columns(const char *spec, uint32_t *columns);
+int	rc_log_header_columns(int fd, bool binary, bool compress,
+                uint32_t columns);
+int	rc_log_text(const struct rc_log_rec *r, uint32_t columns, char *buf,
+                size_t len);
+size_t	rc_log_binary_size(uint32_t columns);
+size_t	rc_log_binary(const struct rc_log_rec *r, uint32_t columns, char *buf);
+
+int	rc_recorder_init(rotorcraft_recorder_s **recorder, double duration,
+                const char *prefix);
+int	rc_recorder_resize(rotorcraft_recorder_s *r, double duration);
+void	rc_recorder_fini(rotorcraft_recorder_s **recorder);
+bool	rc_recorder_enabled(const rotorcraft_recorder_s *r);
+void	rc_recorder_push(rotorcraft_recorder_s *r, const struct rc_log_rec *rec);
+const char *
+	rc_recorder_trigger(rotorcraft_recorder_s *r, const char *reason);
+
+void	rc_stream_send(rotorcraft_stream_s *stream,
+                const struct rc_log_rec *r);
+
+void	rc_capture_msg(rotorcraft_capture_s *capture, const uint8_t *msg,
+                uint8_t len, uint8_t off, uint8_t id, const or_time_ts *ts,
+                struct timeval atv);
+
+genom_event	mk_send_velocity(const rotorcraft_conn_s *conn,
+                        rotorcraft_ids_rotor_data_s *rotor_data,
+                        const or_rotorcraft_rotor_control *desired,
+                        const rotorcraft_ids_servo_s *servo,
+                        const genom_context self);
+genom_event	mk_send_throttle(const rotorcraft_conn_s *conn,
+                        rotorcraft_ids_rotor_data_s *rotor_data,
+                        const or_rotorcraft_rotor_control *desired,
+                        const rotorcraft_ids_servo_s *servo,
+                        const genom_context self);
+int	mk_resend_setpoint(const rotorcraft_conn_s *conn, char cmd,
+                        rotorcraft_ids_rotor_data_s *rotor_data, uint32_t l,
+                        const rotorcraft_ids_servo_s *servo);
+
+/* update setpoint delay statistics, given the imu data arrival time */
+static inline void
+mk_sync_delay(struct mk_channel_s *chan, const struct timeval *imu)
+{
+  struct timeval tv;
+  double d;
+
+  if (!imu->tv_sec) return;
+
+  gettimeofday(&tv, NULL);
+  d = tv.tv_sec - imu->tv_sec + (tv.tv_usec - imu->tv_usec) * 1e-6;
+  chan->sync.phase += 0.01 * (d - chan->sync.phase);
+  chan->sync.jitter += 0.01 * (fabs(d - chan->sync.phase) - chan->sync.jitter);
+}
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-  int	mk_calibration_init(uint32_t sstill, uint32_t nposes, uint32_t sps,
+  int	mk_calibration_init(rotorcraft_calibration_s **calibration,
+                uint32_t sstill, uint32_t nposes, uint32_t sps,
                 double tolerance);
-  int	mk_calibration_collect(double temp, or_pose_estimator_state *imu_data,
+  int	mk_calibration_collect(rotorcraft_calibration_s *calib, double temp,
+                or_pose_estimator_state *imu_data,
                 or_pose_estimator_state *mag_data, int32_t *still);
-  int	mk_calibration_acc(double ascale[9], double abias[3]);
-  int	mk_calibration_gyr(double gscale[9], double gbias[3]);
-  int	mk_calibration_mag(double mscale[9], double mbias[3]);
-  void	mk_calibration_fini(double stddeva[3], double stddevw[3],
-                double stddevm[3], double *maxa, double *maxw, double *avgtemp,
+  int	mk_calibration_acc(rotorcraft_calibration_s *calib,
+                double ascale[9], double abias[3]);
+  int	mk_calibration_gyr(rotorcraft_calibration_s *calib,
+                double gscale[9], double gbias[3]);
+  int	mk_calibration_mag(rotorcraft_calibration_s *calib,
+                double mscale[9], double mbias[3]);
+  void	mk_calibration_fini(rotorcraft_calibration_s **calibration,
+                double stddeva[3], double stddevw[3], double stddevm[3],
+                double *maxa, double *maxw, double *avgtemp,
                 double *avga, double *avgw);
-  void	mk_calibration_log(const char *path);
+  void	mk_calibration_log(const rotorcraft_calibration_s *calib,
+                const char *path);
+  int	mk_calibration_solve(rotorcraft_calibration_s *calib,
+                const char *path, bool imu, bool mag,
+                const rotorcraft_ids_imu_calibration_s *cal);
+  int	mk_calibration_result(rotorcraft_calibration_s **calibration,
+                rotorcraft_ids_imu_calibration_s *cal,
+                double maxa[3], double maxw[3], double *avga, double *avgw);
+  int	mk_calibration_cancel(rotorcraft_calibration_s **calibration);
 
   void	mk_calibration_rotate(double r[9], double s[9]);
   void	mk_calibration_bias(double b1[3], double s[9], double b[3]);
@@ -0,0 +1,1121 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#define _GNU_SOURCE /* fallocate */
+#include "acrotorcraft.h"
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <aio.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "codels.h"
+#include "logfmt.h"
+#include "logz.h"
+#include "ring.h"
+
+/* column groups, in log order */
+static const struct {
+  enum rc_log_column column;
+  const char *name;
+  const char *header;
+  char type;		/* binary type: f (float) or u (uint8) */
+} rc_log_groups[] = {
+  { RC_LOG_RATE,	"rate",	rc_log_header_rate,	'f' },
+  { RC_LOG_BAT,		"bat",	rc_log_header_bat,	'f' },
+  { RC_LOG_IMU,		"imu",	rc_log_header_imu,	'f' },
+  { RC_LOG_MAG,		"mag",	rc_log_header_mag,	'f' },
+  { RC_LOG_CMD,		"cmd",	rc_log_header_cmd,	'f' },
+  { RC_LOG_MEAS,	"meas",	rc_log_header_meas,	'f' },
+  { RC_LOG_CLK,		"clk",	rc_log_header_clk,	'u' },
+};
+
+
+/* --- rc_log_alloc -------------------------------------------------------- */
+
+/* (Re)allocate the log buffers according to the configuration. */
+
+int
+rc_log_alloc(rotorcraft_log_s *log)
+{
+  struct rc_log_buf *buf;
+  char *data;
+  uint32_t i;
+
+  if (log->buf &&
+      log->nbuf == log->cfg.count && log->bufsize == log->cfg.size) {
+    log->r = log->w = 0;
+    for(i = 0; i < log->nbuf; i++) log->buf[i].len = 0;
+    return 0;
+  }
+
+  buf = malloc(log->cfg.count * sizeof(*buf));
+  data = malloc(log->cfg.count * log->cfg.size);
+  if (!buf || !data) {
+    free(buf);
+    free(data);
+    return -1;
+  }
+
+  if (log->buf) {
+    free(log->buf[0].data);
+    free(log->buf);
+  }
+
+  for(i = 0; i < log->cfg.count; i++)
+    buf[i] = (struct rc_log_buf){
+      .data = data + i * log->cfg.size, .len = 0, .tv = { 0 }
+    };
+  log->buf = buf;
+  log->nbuf = log->cfg.count;
+  log->bufsize = log->cfg.size;
+  log->r = log->w = 0;
+  return 0;
+}
+
+
+/* --- rc_log_next --------------------------------------------------------- */
+
+/* Mark the buffer being filled as full and switch to the next one. Returns
+ * -1 if all buffers are full. */
+
+int
+rc_log_next(rotorcraft_log_s *log)
+{
+  uint32_t w;
+
+  if (!log->buf[log->w].len) return 0;
+
+  w = (log->w + 1) % log->nbuf;
+  if (w == log->r) return -1;
+
+  log->w = w;
+  log->buf[w].len = 0;
+  return 0;
+}
+
+
+/* --- rc_log_writer ------------------------------------------------------ */
+
+/* Writer thread, for the text and compressed formats or when rotating logs.
+ * The main task fills record snapshots directly in a lock-free ring and the
+ * thread formats them, or encodes them in chunks of up to rc_log_chunk
+ * records. Formatted records are written when the output buffer is full and
+ * chunks when full, or both when older than cfg.period. Configuration
+ * comments go through the same ring so that they are properly ordered with
+ * records, and kept for the header of the next segment.
+ *
+ * Segments after the first one are named path.1, path.2, ... Once the
+ * current segment is large or old enough, the thread writes pending data,
+ * then opens, preallocates and writes the header of the next one before
+ * switching to it. The main task is not involved. */
+
+#define rc_log_chunk	1024	/* maximum records per chunk */
+#define rc_log_poll	5000000	/* writer polling period, ns */
+#define rc_log_nfield	(2 + 3 + 1 + 13 + 6 + 3 * or_rotorcraft_max_rotors)
+
+struct rc_log_item {
+  char *comment;	/* malloc()ed configuration comment, or NULL */
+  enum rc_log_hdr hdr;	/* header section of the comment */
+  bool write;		/* comment is to be logged */
+  bool skipped;		/* records were missed before this one */
+  struct rc_log_rec r;
+};
+
+struct rc_log_writer {
+  pthread_t thread;
+  int fd, first;	/* current and first segment */
+  bool binary, compress;
+  uint32_t columns;
+  double period;
+
+  struct rc_ring ring;
+
+  /* text and binary formats output */
+  char *buf;
+  size_t len, size;
+
+  /* compressed format encoder */
+  char rec[rc_log_maxrec];
+  struct rc_logz z;
+  struct rc_logz_field field[rc_log_nfield];
+
+  /* rotation */
+  char path[64];
+  uint32_t segment;
+  off_t written, prealloc, rotate_size;
+  double rotate_period;
+  struct timespec start;	/* segment start time */
+  char *hdr[RC_LOG_NHDR];
+
+  atomic_bool stop;
+  atomic_int err;
+};
+
+static size_t
+rc_log_fields(uint32_t columns, struct rc_logz_field *field)
+{
+  size_t n = 0;
+  int i;
+
+#define xfield(t, p)	field[n++] = (struct rc_logz_field){ (t), (p) }
+  xfield(RC_LOGZ_U64, -1);
+  xfield(RC_LOGZ_U32, -1);
+  if (columns & RC_LOG_RATE)
+    for(i = 0; i < 3; i++) xfield(RC_LOGZ_F32, -1);
+  if (columns & RC_LOG_BAT)
+    xfield(RC_LOGZ_F32, 0);
+  if (columns & RC_LOG_IMU)
+    for(i = 0; i < 13; i++) xfield(RC_LOGZ_F32, 1);
+  if (columns & RC_LOG_MAG)
+    for(i = 0; i < 6; i++) xfield(RC_LOGZ_F32, 2);
+  if (columns & RC_LOG_CMD)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++) xfield(RC_LOGZ_F32, 3 + i);
+  if (columns & RC_LOG_MEAS)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++)
+      xfield(RC_LOGZ_F32, 3 + or_rotorcraft_max_rotors + i);
+  if (columns & RC_LOG_CLK)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++) xfield(RC_LOGZ_U8, -1);
+#undef xfield
+
+  return n;
+}
+
+static int
+rc_log_write(int fd, const char *data, size_t len)
+{
+  ssize_t s;
+
+  while (len > 0) {
+    s = write(fd, data, len);
+    if (s < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += s;
+    len -= s;
+  }
+
+  return 0;
+}
+
+static int
+rc_log_writer_write(struct rc_log_writer *wr, const char *data, size_t len)
+{
+  if (rc_log_write(wr->fd, data, len)) return -1;
+  wr->written += len;
+  return 0;
+}
+
+static bool
+rc_log_writer_pending(const struct rc_log_writer *wr)
+{
+  return wr->compress ? wr->z.nrec > 0 : wr->len > 0;
+}
+
+static int
+rc_log_writer_flush(struct rc_log_writer *wr)
+{
+  size_t len;
+
+  if (wr->compress) {
+    len = rc_logz_flush(&wr->z);
+    return rc_log_writer_write(wr, (const char *)wr->z.buf, len);
+  }
+
+  len = wr->len;
+  wr->len = 0;
+  return rc_log_writer_write(wr, wr->buf, len);
+}
+
+static int
+rc_log_writer_add(struct rc_log_writer *wr, const struct rc_log_item *item)
+{
+  size_t l;
+  int s;
+
+  if (item->comment) {
+    /* the comment is kept for the next segment header */
+    free(wr->hdr[item->hdr]);
+    wr->hdr[item->hdr] = item->comment;
+    if (!item->write) return 0;
+
+    l = strlen(item->comment);
+    if (l > wr->size - wr->len && rc_log_writer_flush(wr)) return -1;
+    if (l > wr->size) return rc_log_writer_write(wr, item->comment, l);
+    memcpy(wr->buf + wr->len, item->comment, l);
+    wr->len += l;
+    return 0;
+  }
+
+  if (wr->compress) {
+    rc_log_binary(&item->r, wr->columns, wr->rec);
+    s = rc_logz_encode(&wr->z, wr->rec);
+    if (s < 0) { errno = ENOBUFS; return -1; }
+    return s ? rc_log_writer_flush(wr) : 0;
+  }
+
+  if (wr->size - wr->len < 1 + rc_log_maxrec && rc_log_writer_flush(wr))
+    return -1;
+  if (wr->binary) {
+    wr->len += rc_log_binary(&item->r, wr->columns, wr->buf + wr->len);
+    return 0;
+  }
+
+  if (item->skipped) wr->buf[wr->len++] = '\n';
+  s = rc_log_text(&item->r, wr->columns, wr->buf + wr->len, wr->size - wr->len);
+  if (s < 0) { errno = EMSGSIZE; return -1; }
+  wr->len += s;
+  return 0;
+}
+
+/* Whether the current segment is complete. */
+static bool
+rc_log_writer_due(const struct rc_log_writer *wr, const struct timespec *t)
+{
+  if (wr->rotate_size > 0 && wr->written >= wr->rotate_size) return true;
+  if (wr->rotate_period > 0. &&
+      t->tv_sec - wr->start.tv_sec + 1e-9 * (t->tv_nsec - wr->start.tv_nsec)
+      >= wr->rotate_period)
+    return true;
+  return false;
+}
+
+/* Release unused preallocated space of the current segment and close it,
+ * unless it is the first one which belongs to the log. */
+static void
+rc_log_writer_release(struct rc_log_writer *wr)
+{
+  struct stat st;
+
+  if (wr->prealloc > 0 && !fstat(wr->fd, &st) && ftruncate(wr->fd, st.st_size))
+    warn("log");
+  if (wr->fd != wr->first && close(wr->fd)) warn("log");
+}
+
+/* Switch to the next segment, with its own header. */
+static int
+rc_log_writer_rotate(struct rc_log_writer *wr, const struct timespec *t)
+{
+  char path[80], date[32];
+  time_t now;
+  int fd, i;
+
+  if (rc_log_writer_pending(wr) && rc_log_writer_flush(wr)) return -1;
+
+  snprintf(path, sizeof(path), "%s.%u", wr->path, wr->segment + 1);
+  fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) return -1;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (wr->prealloc > 0) fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, wr->prealloc);
+#endif
+
+  now = time(NULL);
+  if (dprintf(fd, "# logged on %s# segment %u of %s\n#\n",
+              ctime_r(&now, date), wr->segment + 1, wr->path) < 0)
+    goto err;
+  for(i = 0; i < RC_LOG_NHDR; i++)
+    if (wr->hdr[i] && rc_log_write(fd, wr->hdr[i], strlen(wr->hdr[i])))
+      goto err;
+  if (rc_log_header_columns(fd, wr->binary, wr->compress, wr->columns))
+    goto err;
+
+  rc_log_writer_release(wr);
+  wr->fd = fd;
+  wr->segment++;
+  wr->written = 0;
+  wr->start = *t;
+  return 0;
+
+err:
+  i = errno;
+  close(fd);
+  errno = i;
+  return -1;
+}
+
+static void *
+rc_log_writer_main(void *arg)
+{
+  struct rc_log_writer *wr = arg;
+  const struct rc_log_item *item;
+  struct timespec t0, t;
+  bool stop;
+  int s;
+
+  do {
+    /* read the stop flag first, so that all records pushed before are
+     * written */
+    stop = atomic_load(&wr->stop);
+
+    while ((item = rc_ring_rptr(&wr->ring))) {
+      if (!rc_log_writer_pending(wr)) clock_gettime(CLOCK_MONOTONIC, &t0);
+      s = rc_log_writer_add(wr, item);
+      rc_ring_pop(&wr->ring);
+      if (s) goto err;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if (rc_log_writer_pending(wr)) {
+      if (stop ||
+          t.tv_sec - t0.tv_sec + 1e-9 * (t.tv_nsec - t0.tv_nsec) >= wr->period)
+        if (rc_log_writer_flush(wr)) goto err;
+    }
+    if (!stop && rc_log_writer_due(wr, &t) && rc_log_writer_rotate(wr, &t))
+      goto err;
+
+    if (!stop)
+      nanosleep(&(struct timespec){ .tv_nsec = rc_log_poll }, NULL);
+  } while (!stop);
+
+  return NULL;
+err:
+  atomic_store(&wr->err, errno ? errno : EIO);
+  return NULL;
+}
+
+static int
+rc_log_writer_start(rotorcraft_log_s *log)
+{
+  struct rc_log_writer *wr;
+  size_t n;
+  int i;
+
+  wr = malloc(sizeof(*wr));
+  if (!wr) return -1;
+
+  wr->fd = wr->first = log->fd;
+  wr->binary = log->binary;
+  wr->compress = log->compress;
+  wr->columns = log->columns;
+  wr->period = log->cfg.period;
+  wr->buf = NULL;
+  wr->len = 0;
+  wr->size = log->cfg.size;
+
+  snprintf(wr->path, sizeof(wr->path), "%s", log->path);
+  wr->segment = 0;
+  wr->written = 0;
+  wr->rotate_size = log->cfg.rotate_size;
+  wr->rotate_period = log->cfg.rotate_period;
+  wr->prealloc = log->cfg.prealloc;
+  if (wr->rotate_size > 0 &&
+      wr->prealloc > wr->rotate_size + (off_t)log->cfg.size)
+    wr->prealloc = wr->rotate_size + log->cfg.size;
+  clock_gettime(CLOCK_MONOTONIC, &wr->start);
+  for(i = 0; i < RC_LOG_NHDR; i++) wr->hdr[i] = NULL;
+
+  atomic_init(&wr->stop, false);
+  atomic_init(&wr->err, 0);
+
+  /* the ring holds as many snapshots as the log buffers would hold binary
+   * records */
+  n = log->cfg.count * log->cfg.size / rc_log_binary_size(log->columns);
+  if (rc_ring_init(&wr->ring, n, sizeof(struct rc_log_item)))
+    goto enomem;
+
+  if (wr->compress) {
+    n = rc_log_fields(log->columns, wr->field);
+    if (rc_logz_init(&wr->z, wr->field, n, rc_log_chunk)) goto enomem_ring;
+  } else {
+    wr->buf = malloc(wr->size);
+    if (!wr->buf) goto enomem_ring;
+  }
+
+  errno = pthread_create(&wr->thread, NULL, rc_log_writer_main, wr);
+  if (errno) {
+    n = errno;
+    if (wr->compress) rc_logz_fini(&wr->z);
+    free(wr->buf);
+    rc_ring_fini(&wr->ring);
+    free(wr);
+    errno = n;
+    return -1;
+  }
+
+  log->writer = wr;
+  return 0;
+
+enomem_ring:
+  rc_ring_fini(&wr->ring);
+enomem:
+  free(wr);
+  errno = ENOMEM;
+  return -1;
+}
+
+static void
+rc_log_writer_stop(rotorcraft_log_s *log)
+{
+  struct rc_log_writer *wr = log->writer;
+  const struct rc_log_item *item;
+  int i;
+
+  atomic_store(&wr->stop, true);
+  pthread_join(wr->thread, NULL);
+
+  if (atomic_load(&wr->err)) {
+    errno = atomic_load(&wr->err);
+    warn("log");
+  }
+  rc_log_writer_release(wr);
+
+  /* release comments left after an error */
+  while ((item = rc_ring_rptr(&wr->ring))) {
+    free(item->comment);
+    rc_ring_pop(&wr->ring);
+  }
+  for(i = 0; i < RC_LOG_NHDR; i++) free(wr->hdr[i]);
+
+  if (wr->compress) rc_logz_fini(&wr->z);
+  free(wr->buf);
+  rc_ring_fini(&wr->ring);
+  free(wr);
+  log->writer = NULL;
+}
+
+/* Queue a copy of a configuration comment, to be logged or only kept for
+ * the next segment header, waiting for room in the ring. Not for the main
+ * task. */
+static int
+rc_log_writer_comment(rotorcraft_log_s *log, enum rc_log_hdr hdr,
+                      const char *comment, bool write)
+{
+  struct rc_log_writer *wr = log->writer;
+  struct rc_log_item *item;
+
+  while (!(item = rc_ring_wptr(&wr->ring))) {
+    if (atomic_load(&wr->err)) {
+      errno = atomic_load(&wr->err);
+      return -1;
+    }
+    nanosleep(&(struct timespec){ .tv_nsec = rc_log_poll }, NULL);
+  }
+
+  item->comment = strdup(comment);
+  if (!item->comment) return -1;
+  item->hdr = hdr;
+  item->write = write;
+  item->skipped = false;
+  rc_ring_push(&wr->ring);
+  return 0;
+}
+
+/* Return a free record snapshot, or NULL if the ring is full. */
+struct rc_log_rec *
+rc_log_writer_slot(rotorcraft_log_s *log)
+{
+  struct rc_log_item *item = rc_ring_wptr(&log->writer->ring);
+
+  return item ? &item->r : NULL;
+}
+
+/* Publish the snapshot returned by rc_log_writer_slot(), after log->skipped
+ * records. */
+void
+rc_log_writer_push(rotorcraft_log_s *log)
+{
+  struct rc_log_item *item = rc_ring_wptr(&log->writer->ring);
+
+  item->comment = NULL;
+  item->skipped = log->skipped;
+  rc_ring_push(&log->writer->ring);
+}
+
+/* Return -1 and set errno if the writer thread has failed. */
+int
+rc_log_writer_error(rotorcraft_log_s *log)
+{
+  int e = atomic_load_explicit(&log->writer->err, memory_order_relaxed);
+
+  if (!e) return 0;
+  errno = e;
+  return -1;
+}
+
+
+/* --- rc_log_io_init ----------------------------------------------------- */
+
+/* Prepare asynchronous writes to log->fd: preallocate the file and, if
+ * available, setup an io_uring with the log buffers registered. POSIX aio is
+ * used otherwise. In text or compressed format, or to rotate the log, start
+ * the writer thread instead.
+ * Called outside of the main task. */
+
+int
+rc_log_io_init(rotorcraft_log_s *log)
+{
+  log->io.fd = -1;
+  log->io.pending = false;
+  log->io.written = log->io.allocated = 0;
+  log->io.req = (struct aiocb){
+    .aio_fildes = log->fd,
+    .aio_sigevent = { .sigev_notify = SIGEV_NONE },
+    .aio_lio_opcode = LIO_NOP
+  };
+
+  /* file preallocation, without changing the file size so that O_APPEND
+   * writes still go to the end of data */
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (log->cfg.prealloc > 0 &&
+      !fallocate(log->fd, FALLOC_FL_KEEP_SIZE, 0, log->cfg.prealloc))
+    log->io.allocated = log->cfg.prealloc;
+#endif
+
+#ifdef HAVE_LIBURING
+  log->io.uring = false;
+#endif
+  if (log->compress || !log->binary ||
+      log->cfg.rotate_size > 0 || log->cfg.rotate_period > 0.)
+    return rc_log_writer_start(log);
+
+#ifdef HAVE_LIBURING
+  struct iovec iov = {
+    .iov_base = log->buf[0].data, .iov_len = log->nbuf * log->bufsize
+  };
+
+  log->io.fallocating = false;
+  log->io.uring = !io_uring_queue_init(4, &log->io.ring, 0);
+  if (log->io.uring && io_uring_register_buffers(&log->io.ring, &iov, 1)) {
+    io_uring_queue_exit(&log->io.ring);
+    log->io.uring = false;
+  }
+  if (!log->io.uring) warnx("log: io_uring not available, using POSIX aio");
+#endif
+
+  return 0;
+}
+
+
+/* --- rc_log_io_start ----------------------------------------------------- */
+
+/* Switch to asynchronous writes, once the header is written. */
+
+void
+rc_log_io_start(rotorcraft_log_s *log)
+{
+  log->io.written = lseek(log->fd, 0, SEEK_END);
+  if (log->io.written < 0) log->io.written = 0;
+  log->io.fd = log->fd;
+}
+
+
+/* --- rc_log_io_fini ------------------------------------------------------ */
+
+/* Release asynchronous writes resources and unused preallocated space. Call
+ * rc_log_sync() first. */
+
+void
+rc_log_io_fini(rotorcraft_log_s *log)
+{
+  struct stat st;
+
+  if (log->writer) rc_log_writer_stop(log);
+
+#ifdef HAVE_LIBURING
+  if (log->io.uring) {
+    io_uring_queue_exit(&log->io.ring);
+    log->io.uring = false;
+  }
+#endif
+
+  if (log->io.allocated > 0 && !fstat(log->fd, &st) &&
+      ftruncate(log->fd, st.st_size))
+    warn("log");
+
+  log->io.fd = -1;
+  log->io.pending = false;
+  log->io.allocated = 0;
+}
+
+
+/* --- rc_log_awrite ------------------------------------------------------- */
+
+/* Start writing io->len bytes of io->data. Returns -1 on error. */
+
+static int
+rc_log_awrite(rotorcraft_log_s *log)
+{
+#ifdef HAVE_LIBURING
+  if (log->io.uring) {
+    struct io_uring_sqe *sqe;
+    int s;
+
+    /* extend file preallocation */
+    if (log->io.allocated > 0 && !log->io.fallocating &&
+        log->io.written + (off_t)(log->nbuf * log->bufsize) >
+        log->io.allocated - log->cfg.prealloc / 2) {
+      sqe = io_uring_get_sqe(&log->io.ring);
+      if (sqe) {
+        io_uring_prep_fallocate(sqe, log->io.fd, FALLOC_FL_KEEP_SIZE,
+                                log->io.allocated, log->cfg.prealloc);
+        io_uring_sqe_set_data(sqe, &log->io.allocated);
+        log->io.fallocating = true;
+      }
+    }
+
+    /* log->fd has O_APPEND: offset is not used */
+    sqe = io_uring_get_sqe(&log->io.ring);
+    if (!sqe) { errno = EBUSY; return -1; }
+    io_uring_prep_write_fixed(sqe, log->io.fd, log->io.data, log->io.len,
+                              0, 0);
+    io_uring_sqe_set_data(sqe, &log->io.data);
+
+    s = io_uring_submit(&log->io.ring);
+    if (s < 0) { errno = -s; return -1; }
+    return 0;
+  }
+#endif
+
+  log->io.req.aio_fildes = log->io.fd;
+  log->io.req.aio_buf = (void *)log->io.data;
+  log->io.req.aio_nbytes = log->io.len;
+  return aio_write(&log->io.req);
+}
+
+
+/* --- rc_log_await -------------------------------------------------------- */
+
+/* Check completion of the write in progress, blocking or not. Returns 0 if
+ * the write is still in progress, 1 otherwise with the number of bytes
+ * written (or -1 and errno) in *s. */
+
+static int
+rc_log_await(rotorcraft_log_s *log, bool block, ssize_t *s)
+{
+#ifdef HAVE_LIBURING
+  if (log->io.uring) {
+    struct io_uring_cqe *cqe;
+    bool done = false;
+    int e;
+
+    do {
+      e = block ?
+        io_uring_wait_cqe(&log->io.ring, &cqe) :
+        io_uring_peek_cqe(&log->io.ring, &cqe);
+      if (e == -EAGAIN) return 0;
+      if (e == -EINTR) continue;
+      if (e < 0) { errno = -e; *s = -1; return 1; }
+
+      if (io_uring_cqe_get_data(cqe) == &log->io.allocated) {
+        /* preallocation: stop extending on error */
+        log->io.fallocating = false;
+        if (cqe->res < 0)
+          log->io.allocated = 0;
+        else
+          log->io.allocated += log->cfg.prealloc;
+      } else {
+        *s = cqe->res;
+        if (*s < 0) { errno = -*s; *s = -1; }
+        done = true;
+      }
+      io_uring_cqe_seen(&log->io.ring, cqe);
+    } while (!done);
+
+    return 1;
+  }
+#endif
+
+  const struct aiocb *req = &log->io.req;
+  int e;
+
+  while ((e = aio_error(&log->io.req)) == EINPROGRESS) {
+    if (!block) return 0;
+    if (aio_suspend(&req, 1, NULL) && errno != EINTR) {
+      *s = -1;
+      return 1;
+    }
+  }
+
+  *s = aio_return(&log->io.req);
+  if (*s < 0) errno = e;
+  return 1;
+}
+
+
+/* --- rc_log_reap --------------------------------------------------------- */
+
+/* Check completion of the write in progress, blocking or not. Short writes
+ * are resumed. Returns -1 on error. */
+
+static int
+rc_log_complete(rotorcraft_log_s *log, bool block)
+{
+  ssize_t s;
+
+  while (log->io.pending) {
+    if (!rc_log_await(log, block, &s)) return 0;
+    log->io.pending = false;
+
+    if (s <= 0) {
+      if (!s) errno = EIO;
+      return -1;
+    }
+    log->io.written += s;
+
+    if ((size_t)s < log->io.len) {
+      log->io.data += s;
+      log->io.len -= s;
+      if (rc_log_awrite(log)) return -1;
+      log->io.pending = true;
+      continue;
+    }
+
+    log->buf[log->r].len = 0;
+    log->r = (log->r + 1) % log->nbuf;
+  }
+
+  return 0;
+}
+
+int
+rc_log_reap(rotorcraft_log_s *log)
+{
+  return rc_log_complete(log, false);
+}
+
+
+/* --- rc_log_submit ------------------------------------------------------- */
+
+/* Start writing the oldest full buffer, if no write is in progress. Returns
+ * -1 on error. */
+
+int
+rc_log_submit(rotorcraft_log_s *log)
+{
+  if (log->io.pending || log->r == log->w) return 0;
+
+  log->io.data = log->buf[log->r].data;
+  log->io.len = log->buf[log->r].len;
+  if (rc_log_awrite(log)) return -1;
+
+  log->io.pending = true;
+  return 0;
+}
+
+
+/* --- rc_log_sync --------------------------------------------------------- */
+
+/* Write all buffered data, blocking. Returns -1 on error. */
+
+int
+rc_log_sync(rotorcraft_log_s *log)
+{
+  if (rc_log_complete(log, true)) return -1;
+
+  /* write full buffers, then the buffer being filled */
+  for(;;) {
+    if (log->r == log->w) {
+      if (!log->buf[log->w].len) break;
+      log->w = (log->w + 1) % log->nbuf;
+      log->buf[log->w].len = 0;
+    }
+
+    if (rc_log_submit(log)) return -1;
+    if (rc_log_complete(log, true)) return -1;
+  }
+
+  return 0;
+}
+
+
+/* --- rc_log_printf ------------------------------------------------------- */
+
+/* Formatted configuration comment, kept as the hdr section of the header of
+ * the next segments. Once logging has started, the comment is queued to the
+ * writer thread so that it is properly ordered with log records. There are
+ * no comments within binary records. */
+
+int
+rc_log_printf(rotorcraft_log_s *log, enum rc_log_hdr hdr, const char *fmt,
+              ...)
+{
+  va_list ap;
+  char *str;
+  int s;
+
+  va_start(ap, fmt);
+  s = vasprintf(&str, fmt, ap);
+  va_end(ap);
+  if (s < 0) return -1;
+
+  free(log->hdr[hdr]);
+  log->hdr[hdr] = str;
+
+  /* nothing is written after a writer error, until log_stop */
+  if (log->writer && rc_log_writer_error(log)) return -1;
+  if (log->writer &&
+      rc_log_writer_comment(log, hdr, str, log->io.fd >= 0 && !log->binary))
+    return -1;
+
+  if (log->io.fd < 0) return rc_log_write(log->fd, str, s) ? -1 : s;
+  return s;
+}
+
+
+/* --- rc_log_columns ------------------------------------------------------ */
+
+/* Parse a list of column groups names, separated by spaces or commas. "all"
+ * or an empty list selects all columns. */
+
+int
+rc_log_columns(const char *spec, uint32_t *columns)
+{
+  const char *s, *e;
+  size_t i, l;
+
+  *columns = 0;
+  for(s = spec; *s; s = e) {
+    while (*s && (isspace(*s) || *s == ',')) s++;
+    for(e = s; *e && !isspace(*e) && *e != ','; e++);
+    l = e - s;
+    if (!l) break;
+
+    if (l == 3 && !strncmp(s, "all", 3)) {
+      *columns |= RC_LOG_ALL;
+      continue;
+    }
+
+    for(i = 0; i < sizeof(rc_log_groups)/sizeof(*rc_log_groups); i++)
+      if (strlen(rc_log_groups[i].name) == l &&
+          !strncmp(s, rc_log_groups[i].name, l)) break;
+    if (i >= sizeof(rc_log_groups)/sizeof(*rc_log_groups)) return -1;
+
+    *columns |= rc_log_groups[i].column;
+  }
+
+  if (!*columns) *columns = RC_LOG_ALL;
+  return 0;
+}
+
+
+/* --- rc_log_header_columns ----------------------------------------------- */
+
+/* Write the columns description line. In binary format, each column name is
+ * followed by its type and the line is preceded by the format and presence
+ * bits description. In compressed format, the type of fields with a presence
+ * bit is followed by @bit. Binary records or compressed chunks directly
+ * follow this line. */
+
+int
+rc_log_header_columns(int fd, bool binary, bool compress, uint32_t columns)
+{
+  struct rc_logz_field field[rc_log_nfield];
+  const char *h, *e;
+  size_t i, n;
+  int s;
+
+  if (!binary) {
+    if (columns == RC_LOG_ALL)
+      return dprintf(fd, rc_log_header_fmt "\n") < 0 ? -1 : 0;
+
+    if (dprintf(fd, rc_log_header_ts) < 0) return -1;
+    for(i = 0; i < sizeof(rc_log_groups)/sizeof(*rc_log_groups); i++) {
+      if (!(columns & rc_log_groups[i].column)) continue;
+      if (dprintf(fd, " %s", rc_log_groups[i].header) < 0) return -1;
+    }
+    return dprintf(fd, "\n") < 0 ? -1 : 0;
+  }
+
+  if (dprintf(
+        fd,
+        "# binary format, %s endian, %zu bytes per record\n"
+        "# ts in nanoseconds, present bits: bat imu mag cmd_v0-7 meas_v0-7\n",
+        (union { uint16_t i; uint8_t c[2]; }){ .i = 1 }.c[0] ?
+        "little" : "big", rc_log_binary_size(columns)) < 0)
+    return -1;
+  if (compress &&
+      dprintf(
+        fd, "# compressed chunks of at most %d records, magic 0x%08x\n",
+        rc_log_chunk, RC_LOGZ_MAGIC) < 0)
+    return -1;
+
+  rc_log_fields(columns, field);
+  if (dprintf(fd, rc_log_header_ts ":u64 present:u32") < 0) return -1;
+  for(n = 2, i = 0; i < sizeof(rc_log_groups)/sizeof(*rc_log_groups); i++) {
+    if (!(columns & rc_log_groups[i].column)) continue;
+
+    for(h = rc_log_groups[i].header; *h; h = e, n++) {
+      while (*h == ' ') h++;
+      for(e = h; *e && *e != ' '; e++);
+      s = dprintf(fd, " %.*s:%s", (int)(e - h), h,
+                  rc_log_groups[i].type == 'f' ? "f32" : "u8");
+      if (s >= 0 && compress && field[n].present >= 0)
+        s = dprintf(fd, "@%d", field[n].present);
+      if (s < 0) return -1;
+    }
+  }
+  return dprintf(fd, "\n") < 0 ? -1 : 0;
+}
+
+
+/* --- rc_log_text --------------------------------------------------------- */
+
+/* Format a log record as a line of text, like printf("%g") would for each
+ * value. Returns the line length, or -1 if the buffer is smaller than
+ * rc_log_maxrec. */
+
+int
+rc_log_text(const struct rc_log_rec *r, uint32_t columns, char *buf,
+            size_t len)
+{
+  char *p = buf;
+  int i;
+
+  if (len < rc_log_maxrec) return -1;
+
+#define xput(v, has)                                                    \
+  do {                                                                  \
+    *p++ = ' ';                                                         \
+    if (has) p = rc_log_fmtg(p, v); else *p++ = '-';                    \
+  } while(0)
+
+  /* ts */
+  p = rc_log_fmtu(p, r->sec, 1);
+  *p++ = '.';
+  p = rc_log_fmtu(p, r->nsec, 9);
+  *p++ = ' ';
+
+  /* rate */
+  if (columns & RC_LOG_RATE) {
+    for(i = 0; i < 3; i++) xput(r->rate[i], 1);
+    *p++ = ' ';
+  }
+
+  /* bat */
+  if (columns & RC_LOG_BAT) {
+    xput(r->bat, r->present & rc_log_has_bat);
+    *p++ = ' ';
+  }
+
+  /* imu: temp, then groups of 3 separated by two spaces */
+  if (columns & RC_LOG_IMU) {
+    for(i = 0; i < 13; i++) {
+      if (i % 3 == 1) *p++ = ' ';
+      xput(r->imu[i], r->present & rc_log_has_imu);
+    }
+    *p++ = ' ';
+  }
+
+  /* mag */
+  if (columns & RC_LOG_MAG) {
+    for(i = 0; i < 6; i++) {
+      if (i == 3) *p++ = ' ';
+      xput(r->mag[i], r->present & rc_log_has_mag);
+    }
+    *p++ = ' ';
+  }
+
+  /* cmd */
+  if (columns & RC_LOG_CMD)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++)
+      xput(r->cmd[i], r->present & rc_log_has_cmd(i));
+
+  /* meas */
+  if (columns & RC_LOG_MEAS)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++)
+      xput(r->meas[i], r->present & rc_log_has_meas(i));
+
+  /* clk */
+  if (columns & RC_LOG_CLK)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++) {
+      *p++ = ' ';
+      p = rc_log_fmtu(p, r->clk[i], 1);
+    }
+
+  *p++ = '\n';
+#undef xput
+
+  return p - buf;
+}
+
+
+/* --- rc_log_binary ------------------------------------------------------- */
+
+/* Binary records have fixed-width fields in host byte order: a 64 bits
+ * timestamp in nanoseconds, the 32 bits presence bitmask, then the selected
+ * columns as 32 bits floats (8 bits unsigned for clk). Absent fields are
+ * NaN. */
+
+size_t
+rc_log_binary_size(uint32_t columns)
+{
+  size_t s = sizeof(uint64_t) + sizeof(uint32_t);
+
+  if (columns & RC_LOG_RATE)	s += 3 * sizeof(float);
+  if (columns & RC_LOG_BAT)	s += sizeof(float);
+  if (columns & RC_LOG_IMU)	s += 13 * sizeof(float);
+  if (columns & RC_LOG_MAG)	s += 6 * sizeof(float);
+  if (columns & RC_LOG_CMD)	s += or_rotorcraft_max_rotors * sizeof(float);
+  if (columns & RC_LOG_MEAS)	s += or_rotorcraft_max_rotors * sizeof(float);
+  if (columns & RC_LOG_CLK)	s += or_rotorcraft_max_rotors;
+
+  return s;
+}
+
+size_t
+rc_log_binary(const struct rc_log_rec *r, uint32_t columns, char *buf)
+{
+  uint64_t ts;
+  char *p = buf;
+  float f;
+  int i;
+
+#define xput(v, has)                                                    \
+  do {                                                                  \
+    f = (has) ? (v) : NAN;                                              \
+    memcpy(p, &f, sizeof(f));                                           \
+    p += sizeof(f);                                                     \
+  } while(0)
+
+  ts = r->sec * 1000000000ULL + r->nsec;
+  memcpy(p, &ts, sizeof(ts)); p += sizeof(ts);
+  memcpy(p, &r->present, sizeof(r->present)); p += sizeof(r->present);
+
+  if (columns & RC_LOG_RATE)
+    for(i = 0; i < 3; i++) xput(r->rate[i], 1);
+  if (columns & RC_LOG_BAT)
+    xput(r->bat, r->present & rc_log_has_bat);
+  if (columns & RC_LOG_IMU)
+    for(i = 0; i < 13; i++) xput(r->imu[i], r->present & rc_log_has_imu);
+  if (columns & RC_LOG_MAG)
+    for(i = 0; i < 6; i++) xput(r->mag[i], r->present & rc_log_has_mag);
+  if (columns & RC_LOG_CMD)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++)
+      xput(r->cmd[i], r->present & rc_log_has_cmd(i));
+  if (columns & RC_LOG_MEAS)
+    for(i = 0; i < or_rotorcraft_max_rotors; i++)
+      xput(r->meas[i], r->present & rc_log_has_meas(i));
+  if (columns & RC_LOG_CLK) {
+    memcpy(p, r->clk, or_rotorcraft_max_rotors);
+    p += or_rotorcraft_max_rotors;
+  }
+#undef xput
+
+  return p - buf;
+}
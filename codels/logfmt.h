@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#ifndef H_ROTORCRAFT_LOGFMT
+#define H_ROTORCRAFT_LOGFMT
+
+/* Number formatting for text log records, without the locale and stream
+ * overhead of printf(3). C only, this is not to be included from C++
+ * sources. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Append u in decimal, with at least width digits. */
+
+static inline char *
+rc_log_fmtu(char *p, uint64_t u, int width)
+{
+  char d[20];
+  int n = 0;
+
+  do d[n++] = '0' + u % 10; while ((u /= 10) || n < width);
+  while (n) *p++ = d[--n];
+  return p;
+}
+
+/* Append x formatted like printf("%g"). The 6 significant digits are
+ * obtained by scaling x with an exact power of ten, so that rounding is
+ * exact unless the scaled value is within its own error of a rounding tie.
+ * printf is used in that case and for non-finite or out of range values.
+ * The tie check is done before adjusting the exponent, because a scaled
+ * value rounded onto 99999.5 or 999999.5 would otherwise select the wrong
+ * exponent. */
+
+static inline char *
+rc_log_fmtg(char *p, double x)
+{
+  static const double p10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  char d[6];
+  double a, m;
+  uint32_t u;
+  int e, k, i, n;
+
+  if (x == 0.) {
+    if (signbit(x)) *p++ = '-';
+    *p++ = '0';
+    return p;
+  }
+  if (!isfinite(x)) goto slow;
+
+  /* m = |x| * 10^(5-e) in [99999.5, 999999.5), e being the decimal exponent
+   * of x rounded to 6 digits. The initial estimate is within one. */
+  a = fabs(x);
+  e = (ilogb(a) * 78913) >> 18;
+  for(i = 0;; i++) {
+    k = 5 - e;
+    if (i > 2 || k > 22 || k < -22) goto slow;
+    m = k >= 0 ? a * p10[k] : a / p10[-k];
+    if (fabs(m - floor(m) - 0.5) < 1e-15 * m) goto slow;
+    if (m < 99999.5) e--;
+    else if (m >= 999999.5) e++;
+    else break;
+  }
+
+  u = m + 0.5;
+  for(i = 5; i >= 0; i--, u /= 10) d[i] = '0' + u % 10;
+  for(n = 6; n > 1 && d[n - 1] == '0'; n--);
+
+  if (x < 0.) *p++ = '-';
+  if (e < -4 || e >= 6) {
+    /* d.ddddde+XX */
+    *p++ = d[0];
+    if (n > 1) {
+      *p++ = '.';
+      for(i = 1; i < n; i++) *p++ = d[i];
+    }
+    *p++ = 'e';
+    *p++ = e < 0 ? '-' : '+';
+    return rc_log_fmtu(p, e < 0 ? -e : e, 2);
+  }
+
+  if (e < 0) {
+    /* 0.000ddd */
+    *p++ = '0';
+    *p++ = '.';
+    for(i = -1; i > e; i--) *p++ = '0';
+    for(i = 0; i < n; i++) *p++ = d[i];
+    return p;
+  }
+
+  /* ddd.ddd */
+  for(i = 0; i <= e; i++) *p++ = i < n ? d[i] : '0';
+  if (n > e + 1) {
+    *p++ = '.';
+    for(; i < n; i++) *p++ = d[i];
+  }
+  return p;
+
+slow:
+  return p + sprintf(p, "%g", x);
+}
+
+#endif /* H_ROTORCRAFT_LOGFMT */
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logz.h"
+
+/* delta of delta buckets: prefix length and value bits */
+static const struct { int prefix, bits; } rc_logz_dod[] = {
+  { 2, 12 }, { 3, 20 }, { 4, 32 }, { 4, 64 }
+};
+
+static const size_t rc_logz_size[] = {
+  [RC_LOGZ_U64] = sizeof(uint64_t),
+  [RC_LOGZ_U32] = sizeof(uint32_t),
+  [RC_LOGZ_F32] = sizeof(float),
+  [RC_LOGZ_U8] = sizeof(uint8_t)
+};
+
+/* worst case encoded size, in bits */
+static const size_t rc_logz_maxbits[] = {
+  [RC_LOGZ_U64] = 4 + 64,
+  [RC_LOGZ_U32] = 1 + 32,
+  [RC_LOGZ_F32] = 2 + 5 + 5 + 32,
+  [RC_LOGZ_U8] = 1 + 8
+};
+
+
+/* --- rc_logz_init -------------------------------------------------------- */
+
+/* Initialize an encoder for chunks of up to maxrec records, or a decoder if
+ * maxrec is 0. */
+
+int
+rc_logz_init(struct rc_logz *z, const struct rc_logz_field *field,
+             size_t nfield, uint32_t maxrec)
+{
+  size_t i, bits;
+
+  z->field = field;
+  z->nfield = nfield;
+  z->reclen = rc_logz_reclen(field, nfield);
+
+  z->state = calloc(nfield, sizeof(*z->state));
+  if (!z->state) return -1;
+
+  z->buf = NULL;
+  z->size = 0;
+  z->maxrec = maxrec;
+  if (maxrec) {
+    for(bits = i = 0; i < nfield; i++) bits += rc_logz_maxbits[field[i].type];
+    z->size = sizeof(struct rc_logz_hdr) + (maxrec * bits + 7) / 8;
+    z->buf = malloc(z->size);
+    if (!z->buf) {
+      free(z->state);
+      return -1;
+    }
+  }
+
+  z->nrec = 0;
+  z->bits = 8 * sizeof(struct rc_logz_hdr);
+  return 0;
+}
+
+
+/* --- rc_logz_fini -------------------------------------------------------- */
+
+void
+rc_logz_fini(struct rc_logz *z)
+{
+  free(z->buf);
+  free(z->state);
+  z->buf = NULL;
+  z->state = NULL;
+}
+
+
+/* --- rc_logz_reclen ------------------------------------------------------ */
+
+size_t
+rc_logz_reclen(const struct rc_logz_field *field, size_t nfield)
+{
+  size_t i, l;
+
+  for(l = i = 0; i < nfield; i++) l += rc_logz_size[field[i].type];
+  return l;
+}
+
+
+/* --- bit stream ---------------------------------------------------------- */
+
+static inline void
+rc_logz_put(struct rc_logz *z, uint64_t v, int n)
+{
+  int b;
+
+  while (n > 0) {
+    b = 8 - (z->bits & 7);
+    if (b == 8) z->buf[z->bits >> 3] = 0;
+    if (b > n) b = n;
+
+    z->buf[z->bits >> 3] |=
+      ((v >> (n - b)) & ((1U << b) - 1)) << (8 - (z->bits & 7) - b);
+    z->bits += b;
+    n -= b;
+  }
+}
+
+static inline int
+rc_logz_get(const uint8_t *buf, size_t len, size_t *pos, int n, uint64_t *v)
+{
+  int b;
+
+  if (*pos + n > 8 * len) return -1;
+
+  *v = 0;
+  while (n > 0) {
+    b = 8 - (*pos & 7);
+    if (b > n) b = n;
+
+    *v = (*v << b) |
+      ((buf[*pos >> 3] >> (8 - (*pos & 7) - b)) & ((1U << b) - 1));
+    *pos += b;
+    n -= b;
+  }
+  return 0;
+}
+
+static inline int
+rc_logz_clz32(uint32_t x)
+{
+  return x ? __builtin_clz(x) : 32;
+}
+
+static inline int
+rc_logz_ctz32(uint32_t x)
+{
+  return x ? __builtin_ctz(x) : 32;
+}
+
+
+/* --- rc_logz_encode ------------------------------------------------------ */
+
+/* Append a record to the current chunk. Returns 1 when the chunk is full and
+ * must be flushed. */
+
+int
+rc_logz_encode(struct rc_logz *z, const void *rec)
+{
+  const uint8_t *p = rec;
+  struct rc_logz_state *s;
+  uint64_t u64;
+  int64_t d, dod;
+  uint32_t u32, x;
+  uint8_t u8;
+  int lz, tz, l;
+  size_t i, k;
+  bool mask;
+
+  if (z->nrec >= z->maxrec) { errno = ENOBUFS; return -1; }
+
+  /* reset the state at each chunk start, so that chunks are independent */
+  if (!z->nrec) {
+    memset(z->state, 0, z->nfield * sizeof(*z->state));
+    for(i = 0; i < z->nfield; i++) z->state[i].lz = 0xff;
+  }
+
+  z->present = ~0U;
+  mask = false;
+  for(i = 0; i < z->nfield; i++) {
+    s = &z->state[i];
+    if (z->field[i].present >= 0 &&
+        !(z->present & (1U << z->field[i].present))) {
+      p += rc_logz_size[z->field[i].type];
+      continue;
+    }
+
+    switch(z->field[i].type) {
+      case RC_LOGZ_U64:
+        memcpy(&u64, p, sizeof(u64));
+        if (!z->nrec) {
+          /* first value and header timestamp */
+          rc_logz_put(z, u64, 64);
+          if (i == 0) memcpy(z->buf + offsetof(struct rc_logz_hdr, ts),
+                             &u64, sizeof(u64));
+          s->d = 0;
+        } else {
+          d = u64 - s->v;
+          dod = d - s->d;
+          s->d = d;
+
+          if (!dod)
+            rc_logz_put(z, 0, 1);
+          else {
+            for(k = 0;
+                k < sizeof(rc_logz_dod)/sizeof(*rc_logz_dod) - 1; k++) {
+              l = rc_logz_dod[k].bits;
+              if (dod >= -(1LL << (l-1)) && dod < (1LL << (l-1))) break;
+            }
+            rc_logz_put(z, (1U << rc_logz_dod[k].prefix) - 2 + (k == 3),
+                        rc_logz_dod[k].prefix);
+            rc_logz_put(z, dod, rc_logz_dod[k].bits);
+          }
+        }
+        s->v = u64;
+        break;
+
+      case RC_LOGZ_U32:
+        memcpy(&u32, p, sizeof(u32));
+        if (z->nrec && u32 == s->v)
+          rc_logz_put(z, 0, 1);
+        else {
+          rc_logz_put(z, 1, 1);
+          rc_logz_put(z, u32, 32);
+        }
+        s->v = u32;
+        /* the first u32 field is the presence bitmask */
+        if (!mask) { z->present = u32; mask = true; }
+        break;
+
+      case RC_LOGZ_F32:
+        memcpy(&u32, p, sizeof(u32));
+        x = u32 ^ (uint32_t)s->v;
+        if (!x) {
+          rc_logz_put(z, 0, 1);
+          break;
+        }
+
+        lz = rc_logz_clz32(x);
+        tz = rc_logz_ctz32(x);
+        if (s->lz != 0xff && lz >= s->lz && tz >= s->tz) {
+          /* reuse previous meaningful bits window */
+          rc_logz_put(z, 2, 2);
+          rc_logz_put(z, x >> s->tz, 32 - s->lz - s->tz);
+        } else {
+          l = 32 - lz - tz;
+          rc_logz_put(z, 3, 2);
+          rc_logz_put(z, lz, 5);
+          rc_logz_put(z, l - 1, 5);
+          rc_logz_put(z, x >> tz, l);
+          s->lz = lz;
+          s->tz = tz;
+        }
+        s->v = u32;
+        break;
+
+      case RC_LOGZ_U8:
+        u8 = *p;
+        if (z->nrec && u8 == s->v)
+          rc_logz_put(z, 0, 1);
+        else {
+          rc_logz_put(z, 1, 1);
+          rc_logz_put(z, u8, 8);
+        }
+        s->v = u8;
+        break;
+    }
+
+    p += rc_logz_size[z->field[i].type];
+  }
+
+  return ++z->nrec >= z->maxrec;
+}
+
+
+/* --- rc_logz_flush ------------------------------------------------------- */
+
+/* Terminate the current chunk. Returns the chunk size in z->buf, or 0 if
+ * there is no data. A new chunk is started by the next rc_logz_encode(). */
+
+size_t
+rc_logz_flush(struct rc_logz *z)
+{
+  struct rc_logz_hdr h;
+  size_t len;
+
+  if (!z->nrec) return 0;
+
+  len = (z->bits + 7) / 8;
+  memcpy(&h.ts, z->buf + offsetof(struct rc_logz_hdr, ts), sizeof(h.ts));
+  h.magic = RC_LOGZ_MAGIC;
+  h.len = len - sizeof(h);
+  h.nrec = z->nrec;
+  h.reserved = 0;
+  memcpy(z->buf, &h, sizeof(h));
+
+  z->nrec = 0;
+  z->bits = 8 * sizeof(struct rc_logz_hdr);
+  return len;
+}
+
+
+/* --- rc_logz_decode ------------------------------------------------------ */
+
+/* Decode a whole chunk, header included, into rec that must have room for
+ * hdr.nrec records. Fields not present are set to NaN for f32 and to 0
+ * otherwise. Returns the number of records or -1 on error. */
+
+int
+rc_logz_decode(struct rc_logz *z, const void *chunk, size_t len, void *rec)
+{
+  const uint8_t *buf = chunk;
+  struct rc_logz_state *s;
+  struct rc_logz_hdr h;
+  uint8_t *p = rec;
+  size_t pos, i, k;
+  uint64_t v;
+  uint32_t n, u32;
+  int64_t dod;
+  int lz, l;
+  bool mask;
+  float f;
+
+  if (len < sizeof(h)) goto einval;
+  memcpy(&h, buf, sizeof(h));
+  if (h.magic != RC_LOGZ_MAGIC || h.len > len - sizeof(h)) goto einval;
+  len = sizeof(h) + h.len;
+
+  memset(z->state, 0, z->nfield * sizeof(*z->state));
+  pos = 8 * sizeof(h);
+
+  for(n = 0; n < h.nrec; n++) {
+    z->present = ~0U;
+    mask = false;
+    for(i = 0; i < z->nfield; i++) {
+      s = &z->state[i];
+
+      if (z->field[i].present >= 0 &&
+          !(z->present & (1U << z->field[i].present))) {
+        switch(z->field[i].type) {
+          case RC_LOGZ_F32:
+            f = NAN;
+            memcpy(p, &f, sizeof(f));
+            break;
+
+          default:
+            memset(p, 0, rc_logz_size[z->field[i].type]);
+        }
+        p += rc_logz_size[z->field[i].type];
+        continue;
+      }
+
+      switch(z->field[i].type) {
+        case RC_LOGZ_U64:
+          if (!n) {
+            if (rc_logz_get(buf, len, &pos, 64, &s->v)) goto einval;
+            s->d = 0;
+          } else {
+            /* bucket prefix: 0, 10, 110, 1110 or 1111 */
+            for(k = 0; k < 4; k++) {
+              if (rc_logz_get(buf, len, &pos, 1, &v)) goto einval;
+              if (!v) break;
+            }
+            if (!k)
+              dod = 0;
+            else {
+              l = rc_logz_dod[k - 1].bits;
+              if (rc_logz_get(buf, len, &pos, l, &v)) goto einval;
+              dod = l < 64 && (v & (1ULL << (l - 1))) ?
+                (int64_t)(v | ~((1ULL << l) - 1)) : (int64_t)v;
+            }
+            s->d += dod;
+            s->v += s->d;
+          }
+          memcpy(p, &s->v, sizeof(s->v));
+          break;
+
+        case RC_LOGZ_U32:
+          if (rc_logz_get(buf, len, &pos, 1, &v)) goto einval;
+          if (v && rc_logz_get(buf, len, &pos, 32, &s->v)) goto einval;
+          u32 = s->v;
+          memcpy(p, &u32, sizeof(u32));
+          if (!mask) { z->present = u32; mask = true; }
+          break;
+
+        case RC_LOGZ_F32:
+          if (rc_logz_get(buf, len, &pos, 1, &v)) goto einval;
+          if (v) {
+            if (rc_logz_get(buf, len, &pos, 1, &v)) goto einval;
+            if (v) {
+              if (rc_logz_get(buf, len, &pos, 5, &v)) goto einval;
+              lz = v;
+              if (rc_logz_get(buf, len, &pos, 5, &v)) goto einval;
+              l = v + 1;
+              if (lz + l > 32) goto einval;
+              s->lz = lz;
+              s->tz = 32 - lz - l;
+            } else
+              l = 32 - s->lz - s->tz;
+
+            if (rc_logz_get(buf, len, &pos, l, &v)) goto einval;
+            s->v ^= v << s->tz;
+          }
+          u32 = s->v;
+          memcpy(p, &u32, sizeof(u32));
+          break;
+
+        case RC_LOGZ_U8:
+          if (rc_logz_get(buf, len, &pos, 1, &v)) goto einval;
+          if (v && rc_logz_get(buf, len, &pos, 8, &s->v)) goto einval;
+          *p = s->v;
+          break;
+      }
+
+      p += rc_logz_size[z->field[i].type];
+    }
+  }
+
+  return h.nrec;
+einval:
+  errno = EINVAL;
+  return -1;
+}
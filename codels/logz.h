@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#ifndef H_ROTORCRAFT_LOGZ
+#define H_ROTORCRAFT_LOGZ
+
+/* Compressed log chunks.
+ *
+ * Binary log records are a sequence of fixed width fields. Records are
+ * grouped in independent chunks, each starting with a struct rc_logz_hdr
+ * followed by a bit stream. In the bit stream, u64 fields use delta of delta
+ * encoding, f32 fields use the XOR encoding of Pelkonen et al., "Gorilla: a
+ * fast, scalable, in-memory time series database", VLDB 2015, and other
+ * fields are either flagged as unchanged or stored verbatim. Fields with a
+ * presence bit that is not set in the record u32 field are not stored. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum rc_logz_type {
+  RC_LOGZ_U64,
+  RC_LOGZ_U32,
+  RC_LOGZ_F32,
+  RC_LOGZ_U8
+};
+
+struct rc_logz_field {
+  enum rc_logz_type type;
+  int present;		/* presence bit, or -1 */
+};
+
+#define RC_LOGZ_MAGIC	0x5a43525fU	/* "_RCZ" */
+
+struct rc_logz_hdr {
+  uint32_t magic;
+  uint32_t len;		/* bit stream length in bytes */
+  uint32_t nrec;	/* number of records */
+  uint32_t reserved;
+  uint64_t ts;		/* first u64 field of the first record */
+};
+
+struct rc_logz {
+  const struct rc_logz_field *field;
+  size_t nfield, reclen;
+
+  /* current chunk */
+  uint8_t *buf;
+  size_t size, bits;
+  uint32_t nrec, maxrec;
+
+  /* per field state */
+  struct rc_logz_state {
+    uint64_t v;
+    int64_t d;
+    uint8_t lz, tz;
+  } *state;
+  uint32_t present;
+};
+
+int	rc_logz_init(struct rc_logz *z, const struct rc_logz_field *field,
+                size_t nfield, uint32_t maxrec);
+void	rc_logz_fini(struct rc_logz *z);
+size_t	rc_logz_reclen(const struct rc_logz_field *field, size_t nfield);
+
+int	rc_logz_encode(struct rc_logz *z, const void *rec);
+size_t	rc_logz_flush(struct rc_logz *z);
+
+int	rc_logz_decode(struct rc_logz *z, const void *chunk, size_t len,
+                void *rec);
+
+#endif /* H_ROTORCRAFT_LOGZ */
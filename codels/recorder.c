@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include "acrotorcraft.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rotorcraft_c_types.h"
+#include "codels.h"
+
+/* Flight recorder: the main task stores every period a binary log record
+ * with all columns in a preallocated ring, overwriting the oldest one. On
+ * faults or on request, the ring is frozen and a separate thread writes it
+ * as a binary log. The main task does not record while the ring is frozen.
+ *
+ * The ring is only modified by codels of the main task or by codels
+ * serialized with them, so that only the frozen flag is shared with the
+ * dump thread. */
+
+struct rotorcraft_recorder_s {
+  char *data;		/* ring of records */
+  size_t reclen;
+  uint32_t n;		/* capacity, 0 if disabled */
+  uint64_t w;		/* records written */
+  char prefix[64];
+
+  /* dump thread */
+  pthread_t thread;
+  sem_t sem;
+  atomic_bool frozen, quit;
+  uint64_t dw;		/* records written when frozen */
+  char reason[32], path[128];
+  time_t date;
+  uint32_t dumps;
+};
+
+
+/* --- rc_recorder_main ---------------------------------------------------- */
+
+static int
+rc_recorder_write(int fd, const char *data, size_t len)
+{
+  ssize_t s;
+
+  while (len > 0) {
+    s = write(fd, data, len);
+    if (s < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    data += s;
+    len -= s;
+  }
+  return 0;
+}
+
+static void *
+rc_recorder_main(void *arg)
+{
+  rotorcraft_recorder_s *r = arg;
+  uint32_t i, count, l;
+  char date[32];
+  int fd;
+
+  for(;;) {
+    if (sem_wait(&r->sem)) continue;
+
+    if (atomic_load(&r->frozen)) {
+      /* records in chronological order, in the binary log format */
+      count = r->dw > r->n ? r->n : r->dw;
+      i = (r->dw - count) % r->n;
+      l = count < r->n - i ? count : r->n - i;
+
+      fd = open(r->path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+      if (fd < 0)
+        warn("recorder: %s", r->path);
+      else {
+        if (dprintf(fd, "# flight recorder dump on %s, %s#\n",
+                    r->reason, ctime_r(&r->date, date)) < 0 ||
+            rc_log_header_columns(fd, true, false, RC_LOG_ALL) ||
+            rc_recorder_write(fd, r->data + i * r->reclen, l * r->reclen) ||
+            rc_recorder_write(fd, r->data, (count - l) * r->reclen))
+          warn("recorder: %s", r->path);
+        if (close(fd)) warn("recorder: %s", r->path);
+      }
+
+      atomic_store(&r->frozen, false);
+    }
+
+    if (atomic_load(&r->quit)) break;
+  }
+
+  return NULL;
+}
+
+
+/* --- rc_recorder_init ---------------------------------------------------- */
+
+/* Allocate the recorder and start its dump thread. */
+
+int
+rc_recorder_init(rotorcraft_recorder_s **recorder, double duration,
+                 const char *prefix)
+{
+  rotorcraft_recorder_s *r;
+
+  r = malloc(sizeof(*r));
+  if (!r) return -1;
+
+  r->data = NULL;
+  r->reclen = rc_log_binary_size(RC_LOG_ALL);
+  r->n = 0;
+  r->w = 0;
+  snprintf(r->prefix, sizeof(r->prefix), "%s", prefix);
+  atomic_init(&r->frozen, false);
+  atomic_init(&r->quit, false);
+  r->dumps = 0;
+
+  if (sem_init(&r->sem, 0, 0)) {
+    free(r);
+    return -1;
+  }
+  errno = pthread_create(&r->thread, NULL, rc_recorder_main, r);
+  if (errno) {
+    sem_destroy(&r->sem);
+    free(r);
+    return -1;
+  }
+
+  *recorder = r;
+  return rc_recorder_resize(r, duration);
+}
+
+
+/* --- rc_recorder_resize -------------------------------------------------- */
+
+/* (Re)allocate the ring for duration seconds of records, or disable the
+ * recorder if duration is 0. Fails with EBUSY during a dump. */
+
+int
+rc_recorder_resize(rotorcraft_recorder_s *r, double duration)
+{
+  uint32_t n;
+  char *data;
+
+  if (atomic_load(&r->frozen)) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  n = duration * 1000. / rotorcraft_control_period_ms;
+  data = NULL;
+  if (n) {
+    data = malloc(n * r->reclen);
+    if (!data) return -1;
+  }
+
+  free(r->data);
+  r->data = data;
+  r->n = n;
+  r->w = 0;
+  return 0;
+}
+
+
+/* --- rc_recorder_fini ---------------------------------------------------- */
+
+void
+rc_recorder_fini(rotorcraft_recorder_s **recorder)
+{
+  rotorcraft_recorder_s *r = *recorder;
+
+  if (!r) return;
+
+  /* let a pending dump complete */
+  atomic_store(&r->quit, true);
+  sem_post(&r->sem);
+  pthread_join(r->thread, NULL);
+
+  sem_destroy(&r->sem);
+  free(r->data);
+  free(r);
+  *recorder = NULL;
+}
+
+
+/* --- rc_recorder_push ---------------------------------------------------- */
+
+/* Whether records are currently stored. */
+
+bool
+rc_recorder_enabled(const rotorcraft_recorder_s *r)
+{
+  return r && r->n &&
+    !atomic_load_explicit(&r->frozen, memory_order_acquire);
+}
+
+/* Store a record, unless the recorder is disabled or frozen. */
+
+void
+rc_recorder_push(rotorcraft_recorder_s *r, const struct rc_log_rec *rec)
+{
+  if (!rc_recorder_enabled(r)) return;
+
+  rc_log_binary(rec, RC_LOG_ALL, r->data + (r->w % r->n) * r->reclen);
+  r->w++;
+}
+
+
+/* --- rc_recorder_trigger ------------------------------------------------- */
+
+/* Freeze the ring and start writing it to a new file named after the
+ * prefix, date and reason. Returns the file name, or NULL if the recorder
+ * is disabled, empty or already dumping. */
+
+const char *
+rc_recorder_trigger(rotorcraft_recorder_s *r, const char *reason)
+{
+  struct tm tm;
+  char date[32];
+
+  if (!r || !r->n || !r->w) return NULL;
+  if (atomic_load(&r->frozen)) return NULL;
+
+  r->dw = r->w;
+  r->date = time(NULL);
+  snprintf(r->reason, sizeof(r->reason), "%s", reason);
+  strftime(date, sizeof(date), "%Y%m%d-%H%M%S",
+           localtime_r(&r->date, &tm));
+  snprintf(r->path, sizeof(r->path), "%s-%s-%u-%s.log",
+           r->prefix, date, r->dumps++, reason);
+
+  atomic_store_explicit(&r->frozen, true, memory_order_release);
+  sem_post(&r->sem);
+  return r->path;
+}
+
+
+/* --- Function set_recorder -------------------------------------------- */
+
+/** Codel rc_set_recorder of function set_recorder.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_sys, rotorcraft_e_range.
+ */
+genom_event
+rc_set_recorder(double duration, const char prefix[64],
+                rotorcraft_recorder_s **recorder, const genom_context self)
+{
+  if (!(duration >= 0.) || duration > 3600.) return rotorcraft_e_range(self);
+
+  if (rc_recorder_resize(*recorder, duration))
+    return mk_e_sys_error("recorder", self);
+  snprintf((*recorder)->prefix, sizeof((*recorder)->prefix), "%s", prefix);
+
+  return genom_ok;
+}
+
+
+/* --- Function recorder_dump ------------------------------------------- */
+
+/** Codel rc_recorder_dump of function recorder_dump.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_sys.
+ */
+genom_event
+rc_recorder_dump(rotorcraft_recorder_s **recorder, char path[128],
+                 const genom_context self)
+{
+  const char *p;
+
+  p = rc_recorder_trigger(*recorder, "request");
+  if (!p) {
+    errno = (*recorder)->n && (*recorder)->w ? EBUSY : ENODATA;
+    return mk_e_sys_error("recorder", self);
+  }
+
+  snprintf(path, 128, "%s", p);
+  return genom_ok;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#ifndef H_ROTORCRAFT_RING
+#define H_ROTORCRAFT_RING
+
+/* Lock-free, single producer single consumer ring of fixed size elements.
+ *
+ * The producer gets a free slot with rc_ring_wptr(), fills it and publishes
+ * it with rc_ring_push(). The consumer gets the oldest element with
+ * rc_ring_rptr() and releases it with rc_ring_pop(). No call ever blocks, so
+ * that the producer can be a real-time task. C only, this is not to be
+ * included from C++ sources. */
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+struct rc_ring {
+  _Alignas(64) atomic_uint w;	/* producer index */
+  _Alignas(64) atomic_uint r;	/* consumer index */
+
+  _Alignas(64) uint32_t mask;		/* capacity - 1 */
+  size_t size;				/* element size */
+  char *data;
+};
+
+/* Allocate a ring for at least 2 and at most count elements of size bytes.
+ * The capacity is rounded down to a power of 2. */
+static inline int
+rc_ring_init(struct rc_ring *q, uint32_t count, size_t size)
+{
+  uint32_t n;
+
+  for(n = 2; n <= count / 2; n *= 2);
+  q->mask = n - 1;
+  q->size = size;
+  q->data = malloc(n * size);
+  if (!q->data) return -1;
+
+  atomic_init(&q->w, 0);
+  atomic_init(&q->r, 0);
+  return 0;
+}
+
+static inline void
+rc_ring_fini(struct rc_ring *q)
+{
+  free(q->data);
+  q->data = NULL;
+}
+
+static inline uint32_t
+rc_ring_capacity(const struct rc_ring *q)
+{
+  return q->mask + 1;
+}
+
+/* producer side: returns a free slot or NULL if the ring is full */
+static inline void *
+rc_ring_wptr(struct rc_ring *q)
+{
+  uint32_t w = atomic_load_explicit(&q->w, memory_order_relaxed);
+
+  if (w - atomic_load_explicit(&q->r, memory_order_acquire) > q->mask)
+    return NULL;
+  return q->data + (w & q->mask) * q->size;
+}
+
+static inline void
+rc_ring_push(struct rc_ring *q)
+{
+  atomic_fetch_add_explicit(&q->w, 1, memory_order_release);
+}
+
+/* consumer side: returns the oldest element or NULL if the ring is empty */
+static inline const void *
+rc_ring_rptr(struct rc_ring *q)
+{
+  uint32_t r = atomic_load_explicit(&q->r, memory_order_relaxed);
+
+  if (r == atomic_load_explicit(&q->w, memory_order_acquire)) return NULL;
+  return q->data + (r & q->mask) * q->size;
+}
+
+static inline void
+rc_ring_pop(struct rc_ring *q)
+{
+  atomic_fetch_add_explicit(&q->r, 1, memory_order_release);
+}
+
+/* consumer side: returns the oldest elements and their number in *n, up to
+ * the end of the ring storage, or NULL if the ring is empty */
+static inline const void *
+rc_ring_rspan(struct rc_ring *q, uint32_t *n)
+{
+  uint32_t r = atomic_load_explicit(&q->r, memory_order_relaxed);
+  uint32_t w = atomic_load_explicit(&q->w, memory_order_acquire);
+
+  if (r == w) return NULL;
+  *n = w - r;
+  if (*n > q->mask + 1 - (r & q->mask)) *n = q->mask + 1 - (r & q->mask);
+  return q->data + (r & q->mask) * q->size;
+}
+
+static inline void
+rc_ring_popn(struct rc_ring *q, uint32_t n)
+{
+  atomic_fetch_add_explicit(&q->r, n, memory_order_release);
+}
+
+#endif /* H_ROTORCRAFT_RING */
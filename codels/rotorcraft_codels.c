@@ -115,6 +115,24 @@ mk_set_battery_limits(double min, double max,
 }
 
 
+/* --- Attribute set_velocity_estimator --------------------------------- */
+
+/** Validation codel mk_set_velocity_estimator of attribute
+ * set_velocity_estimator.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_range.
+ */
+genom_event
+mk_set_velocity_estimator(double tau, double mstddev, double pstddev,
+                          const genom_context self)
+{
+  if (tau < 0. || mstddev <= 0. || pstddev < 0.)
+    return rotorcraft_e_range(self);
+  return genom_ok;
+}
+
+
 /* --- Function set_velocity -------------------------------------------- */
 
 /** Validation codel mk_validate_input of function set_velocity.
@@ -166,24 +184,41 @@ mk_validate_input(const rotorcraft_ids_rotor_data_s rotor_data[8],
  * Throws rotorcraft_e_sys.
  */
 genom_event
-rc_log_open(const char path[64], uint32_t decimation,
-            rotorcraft_log_s **log, const genom_context self)
+rc_log_open(const char path[64], uint32_t decimation, const char format[16],
+            const char columns[128], rotorcraft_log_s **log,
+            const genom_context self)
 {
+  uint32_t c;
+  bool binary, compress;
   int fd;
 
+  compress = false;
+  if (!strcmp(format, "text"))
+    binary = false;
+  else if (!strcmp(format, "binary"))
+    binary = true;
+  else if (!strcmp(format, "compressed"))
+    binary = compress = true;
+  else
+    return rotorcraft_e_range(self);
+  if (rc_log_columns(columns, &c)) return rotorcraft_e_range(self);
+
   fd = open(path, O_WRONLY|O_APPEND|O_CREAT|O_TRUNC, 0666);
   if (fd < 0) return mk_e_sys_error(path, self);
 
-  if ((*log)->fd >= 0)
-    close((*log)->fd);
-  if ((*log)->req.aio_fildes >= 0) {
-    if ((*log)->pending)
-      while (aio_error(&(*log)->req) == EINPROGRESS)
-        /* empty body */;
-  }
+  /* flush and close previous log */
+  mk_log_stop(log, self);
+
   (*log)->fd = fd;
-  (*log)->req.aio_fildes = -1;
-  (*log)->pending = false;
+  snprintf((*log)->path, sizeof((*log)->path), "%s", path);
+  (*log)->binary = binary;
+  (*log)->compress = compress;
+  (*log)->columns = c;
+  if (rc_log_alloc(*log) || rc_log_io_init(*log)) {
+    close(fd);
+    (*log)->fd = -1;
+    return mk_e_sys_error("log", self);
+  }
   (*log)->skipped = false;
   (*log)->decimation = decimation < 1 ? 1 : decimation;
   (*log)->missed = 0;
@@ -224,8 +259,8 @@ rc_log_sensor_rate(const rotorcraft_ids_sensor_time_s_rate_s *rate,
 
   if ((*log)->fd < 0) return genom_ok;
 
-  s = dprintf(
-    (*log)->fd,
+  s = rc_log_printf(
+    *log, RC_LOG_HDR_RATE,
     "# sensor rate\n"
     "# { imu %g mag %g motor %g battery %g }\n",
     rate->imu, rate->mag, rate->motor, rate->battery);
@@ -271,8 +306,8 @@ rc_log_imu_calibration(const rotorcraft_ids_imu_calibration_s *imu_calibration,
 
   if ((*log)->fd < 0) return genom_ok;
 
-  s = dprintf(
-    (*log)->fd,
+  s = rc_log_printf(
+    *log, RC_LOG_HDR_CAL,
     "# IMU calibration (%g°C average)\n"
 #define mk_log_cal(x)                           \
     "# " #x "scale {\n"                         \
@@ -415,8 +450,8 @@ rc_log_imu_filter(const double gfc[3], const double afc[3],
 
   if ((*log)->fd < 0) return genom_ok;
 
-  s = dprintf(
-    (*log)->fd,
+  s = rc_log_printf(
+    *log, RC_LOG_HDR_FILTER,
     "# IMU low-pass filter cutoff frequencies\n"
 #define mk_log_fc(x)                           \
     "# " #x "fc { x %g  y %g  z %g }\n"
@@ -469,6 +504,8 @@ mk_disable_motor(uint16_t motor, const rotorcraft_conn_s *conn,
   /* also stop motor */
   for(i = 0; i < conn->n; i++)
     if (motor >= conn->chan[i].minid && motor <= conn->chan[i].maxid) {
+      conn->chan[i].sp.cmd = 0;
+      conn->chan[i].sync.len = 0;
       mk_send_msg(&conn->chan[i], "x%1", (uint8_t){motor});
       break;
     }
@@ -501,6 +538,13 @@ mk_enable_motor(uint16_t motor, const rotorcraft_conn_s *conn,
   };
   rotor_data[motor - 1].autoconf = false;
 
+  /* forget the setpoint sent while disabled */
+  for(i = 0; i < conn->n; i++)
+    if (motor >= conn->chan[i].minid && motor <= conn->chan[i].maxid) {
+      conn->chan[i].sp.cmd = 0;
+      break;
+    }
+
   /* also restart motor if spinning */
   for(m = 0; m < or_rotorcraft_max_rotors; m++) {
     if (rotor_data[m].state.disabled) continue;
@@ -570,10 +614,49 @@ mk_set_velocity(const rotorcraft_conn_s *conn,
                 rotorcraft_ids_rotor_data_s rotor_data[8],
                 const or_rotorcraft_rotor_control *desired,
                 const genom_context self)
+{
+  return mk_send_velocity(conn, rotor_data, desired, NULL, self);
+}
+
+
+/* --- Function set_throttle -------------------------------------------- */
+
+/** Codel mk_set_throttle of function set_throttle.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_connection, rotorcraft_e_rotor_failure.
+ */
+genom_event
+mk_set_throttle(const rotorcraft_conn_s *conn,
+                rotorcraft_ids_rotor_data_s rotor_data[8],
+                const or_rotorcraft_rotor_control *desired,
+                const genom_context self)
+{
+  return mk_send_throttle(conn, rotor_data, desired, NULL, self);
+}
+
+
+/* --- mk_send_velocity ---------------------------------------------------- */
+
+static void	mk_send_setpoint(const rotorcraft_conn_s *conn, char cmd,
+                        const int16_t *p, uint32_t l, const struct timeval *tv,
+                        const rotorcraft_ids_servo_s *servo);
+
+/* Convert and send velocities. With servo parameters, setpoints identical to
+ * the last ones sent are skipped unless they are older than servo->keepalive
+ * seconds, and setpoints are deferred until the next imu data arrival if
+ * servo->imu_sync is set. */
+
+genom_event
+mk_send_velocity(const rotorcraft_conn_s *conn,
+                 rotorcraft_ids_rotor_data_s *rotor_data,
+                 const or_rotorcraft_rotor_control *desired,
+                 const rotorcraft_ids_servo_s *servo,
+                 const genom_context self)
 {
   int16_t p[or_rotorcraft_max_rotors];
   struct timeval tv;
-  uint32_t i, l, n;
+  uint32_t i, l;
   (void)self;
 
   l = desired->_length;
@@ -592,37 +675,25 @@ mk_set_velocity(const rotorcraft_conn_s *conn,
       copysign(32767, rotor_data[i].wd) : 1000000/2/rotor_data[i].wd;
   }
 
-  /* send */
-  for(i = 0; i < conn->n; i++) {
-    if (l < conn->chan[i].minid) continue;
-
-    if (l <= conn->chan[i].maxid)
-      n = l - conn->chan[i].minid + 1;
-    else
-      n = conn->chan[i].maxid - conn->chan[i].minid + 1;
-    mk_send_msg(&conn->chan[i], "w%@", p + conn->chan[i].minid - 1, n);
-  }
-
+  mk_send_setpoint(conn, 'w', p, l, &tv, servo);
   return genom_ok;
 }
 
 
-/* --- Function set_throttle -------------------------------------------- */
+/* --- mk_send_throttle ---------------------------------------------------- */
+
+/* Convert and send throttles, see mk_send_velocity */
 
-/** Codel mk_set_throttle of function set_throttle.
- *
- * Returns genom_ok.
- * Throws rotorcraft_e_connection, rotorcraft_e_rotor_failure.
- */
 genom_event
-mk_set_throttle(const rotorcraft_conn_s *conn,
-                rotorcraft_ids_rotor_data_s rotor_data[8],
-                const or_rotorcraft_rotor_control *desired,
-                const genom_context self)
+mk_send_throttle(const rotorcraft_conn_s *conn,
+                 rotorcraft_ids_rotor_data_s *rotor_data,
+                 const or_rotorcraft_rotor_control *desired,
+                 const rotorcraft_ids_servo_s *servo,
+                 const genom_context self)
 {
   int16_t p[or_rotorcraft_max_rotors];
   struct timeval tv;
-  uint32_t i, l, n;
+  uint32_t i, l;
   (void)self;
 
   l = desired->_length;
@@ -641,17 +712,138 @@ mk_set_throttle(const rotorcraft_conn_s *conn,
         rotor_data[i].state.disabled ? 0. : desired->_buffer[i] * 1023./100.;
   }
 
-  /* send */
+  mk_send_setpoint(conn, 'q', p, l, &tv, servo);
+  return genom_ok;
+}
+
+
+/* --- mk_resend_setpoint -------------------------------------------------- */
+
+/* Send again the last setpoints of l rotors, without converting the input
+ * again. Returns -1 if some device has no cached setpoint for cmd. */
+
+int
+mk_resend_setpoint(const rotorcraft_conn_s *conn, char cmd,
+                   rotorcraft_ids_rotor_data_s *rotor_data, uint32_t l,
+                   const rotorcraft_ids_servo_s *servo)
+{
+  int16_t p[or_rotorcraft_max_rotors];
+  struct mk_channel_s *chan;
+  struct timeval tv;
+  uint32_t i, n;
+
+  if (l == 0) return 0;
+
   for(i = 0; i < conn->n; i++) {
-    if (l < conn->chan[i].minid) continue;
+    chan = &conn->chan[i];
+    if (l < chan->minid) continue;
 
-    if (l <= conn->chan[i].maxid)
-      n = l - conn->chan[i].minid + 1;
+    if (l <= chan->maxid)
+      n = l - chan->minid + 1;
     else
-      n = conn->chan[i].maxid - conn->chan[i].minid + 1;
-    mk_send_msg(&conn->chan[i], "q%@", p + conn->chan[i].minid - 1, n);
+      n = chan->maxid - chan->minid + 1;
+    if (chan->sp.cmd != cmd || chan->sp.n != n) return -1;
+
+    memcpy(p + chan->minid - 1, chan->sp.p, n * sizeof(*p));
   }
 
+  gettimeofday(&tv, NULL);
+  for(i = 0; i < l; i++) {
+    rotor_data[i].ts.sec = tv.tv_sec;
+    rotor_data[i].ts.nsec = tv.tv_usec * 1000;
+  }
+
+  mk_send_setpoint(conn, cmd, p, l, &tv, servo);
+  return 0;
+}
+
+
+/* --- mk_send_setpoint ---------------------------------------------------- */
+
+static void
+mk_send_setpoint(const rotorcraft_conn_s *conn, char cmd,
+                 const int16_t *p, uint32_t l, const struct timeval *tv,
+                 const rotorcraft_ids_servo_s *servo)
+{
+  const char fmt[] = { cmd, '%', '@', '\0' };
+  struct mk_channel_s *chan;
+  const int16_t *cp;
+  uint32_t i, n;
+  int s;
+
+  /* nothing is sent after an emergency stop, until the next start */
+  if (!mk_estop_lock(conn)) return;
+
+  for(i = 0; i < conn->n; i++) {
+    chan = &conn->chan[i];
+    if (l < chan->minid) continue;
+
+    if (l <= chan->maxid)
+      n = l - chan->minid + 1;
+    else
+      n = chan->maxid - chan->minid + 1;
+    cp = p + chan->minid - 1;
+
+    /* a setpoint still waiting for imu data is late: replace it */
+    if (chan->sync.len) {
+      chan->sync.len = 0;
+      chan->sync.late++;
+      chan->sp.cmd = 0;
+    }
+
+    /* skip unchanged setpoint, unless keepalive expired */
+    if (servo && servo->keepalive > 0. &&
+        chan->sp.cmd == cmd && chan->sp.n == n &&
+        !memcmp(chan->sp.p, cp, n * sizeof(*cp)) &&
+        tv->tv_sec - chan->sp.tv.tv_sec +
+        (tv->tv_usec - chan->sp.tv.tv_usec) * 1e-6 < servo->keepalive)
+      continue;
+
+    /* wait for imu data, unless imu data is not flowing (10ms) */
+    if (servo && servo->imu_sync &&
+        tv->tv_sec - conn->imu.tv_sec +
+        (tv->tv_usec - conn->imu.tv_usec) * 1e-6 < 0.01)
+      s = mk_defer_msg(chan, fmt, cp, n);
+    else {
+      s = mk_send_msg(chan, fmt, cp, n);
+      if (!s) mk_sync_delay(chan, &conn->imu);
+    }
+    if (s) {
+      chan->sp.cmd = 0;
+      continue;
+    }
+
+    chan->sp.cmd = cmd;
+    chan->sp.n = n;
+    memcpy(chan->sp.p, cp, n * sizeof(*cp));
+    chan->sp.tv = *tv;
+  }
+
+  mk_estop_unlock(conn);
+}
+
+
+/* --- Function emergency_stop ------------------------------------------ */
+
+/** Codel mk_emergency_stop of function emergency_stop.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_sys.
+ */
+genom_event
+mk_emergency_stop(const rotorcraft_conn_s *conn, double *latency,
+                  double *max, const genom_context self)
+{
+  uint32_t i;
+  int s;
+
+  s = mk_estop(conn, latency);
+
+  *max = 0.;
+  for(i = 0; i < conn->n; i++)
+    if (*max < conn->chan[i].estop) *max = conn->chan[i].estop;
+
+  if (s) return mk_e_sys_error("emergency_stop", self);
   return genom_ok;
 }
 
@@ -667,9 +859,15 @@ mk_log_stop(rotorcraft_log_s **log, const genom_context self)
 {
   (void)self; /* -Wunused-parameter */
 
-  if (*log && (*log)->req.aio_fildes >= 0)
-    close((*log)->req.aio_fildes);
-  (*log)->fd = (*log)->req.aio_fildes = -1;
+  if (!*log) return genom_ok;
+
+  if ((*log)->io.fd >= 0 && rc_log_sync(*log))
+    warn("log");
+  if ((*log)->fd >= 0) {
+    rc_log_io_fini(*log);
+    close((*log)->fd);
+  }
+  (*log)->fd = -1;
 
   return genom_ok;
 }
@@ -694,3 +892,75 @@ mk_log_info(const rotorcraft_log_s *log, uint32_t *miss,
   }
   return genom_ok;
 }
+
+
+/* --- Function set_log_buffers ----------------------------------------- */
+
+/** Codel rc_set_log_buffers of function set_log_buffers.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_range.
+ */
+genom_event
+rc_set_log_buffers(uint32_t size, uint16_t count, double period,
+                   uint32_t prealloc, rotorcraft_log_s **log,
+                   const genom_context self)
+{
+  if (size < 4 * rc_log_maxrec || count < 2 || !(period >= 0.))
+    return rotorcraft_e_range(self);
+
+  (*log)->cfg.size = size;
+  (*log)->cfg.count = count;
+  (*log)->cfg.period = period;
+  (*log)->cfg.prealloc = (off_t)prealloc << 20;
+  return genom_ok;
+}
+
+
+/* --- Function set_log_rotation ---------------------------------------- */
+
+/** Codel rc_set_log_rotation of function set_log_rotation.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_range.
+ */
+genom_event
+rc_set_log_rotation(uint32_t size, double period, rotorcraft_log_s **log,
+                    const genom_context self)
+{
+  if (!(period >= 0.)) return rotorcraft_e_range(self);
+
+  (*log)->cfg.rotate_size = (off_t)size << 20;
+  (*log)->cfg.rotate_period = period;
+  return genom_ok;
+}
+
+
+/* --- Function get_servo_timing ---------------------------------------- */
+
+/** Codel mk_get_servo_timing of function get_servo_timing.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+mk_get_servo_timing(const rotorcraft_conn_s *conn, double *phase,
+                    double *jitter, uint32_t *late, const genom_context self)
+{
+  uint32_t i, n;
+  (void)self; /* -Wunused-parameter */
+
+  *phase = *jitter = 0.;
+  *late = 0;
+  for(i = n = 0; i < conn->n; i++) {
+    if (conn->chan[i].fd < 0 || !conn->chan[i].motor) continue;
+
+    *phase += conn->chan[i].sync.phase;
+    if (*jitter < conn->chan[i].sync.jitter)
+      *jitter = conn->chan[i].sync.jitter;
+    *late += conn->chan[i].sync.late;
+    n++;
+  }
+  if (n) *phase /= n;
+
+  return genom_ok;
+}
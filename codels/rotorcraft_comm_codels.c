@@ -78,6 +78,7 @@ static void	mk_comm_recv_msg(struct mk_channel_s *chan,
                         const rotorcraft_imu *imu, const rotorcraft_mag *mag,
                         rotorcraft_ids_rotor_data_s *rotor_data,
                         rotorcraft_ids_battery_s *battery, bool simulate_battery, double *imu_temp,
+                        rotorcraft_capture_s *capture,
                         const genom_context self);
 genom_event	mk_connect_chan(const char serial[64], uint32_t baud,
                         struct mk_channel_s *chan, const genom_context self);
@@ -218,18 +219,34 @@ mk_comm_recv(rotorcraft_conn_s **conn,
              const rotorcraft_imu *imu, const rotorcraft_mag *mag,
              rotorcraft_ids_rotor_data_s rotor_data[8],
              rotorcraft_ids_battery_s *battery, bool simulate_battery,
-             double *imu_temp, const genom_context self)
+             double *imu_temp, rotorcraft_capture_s **capture,
+             const genom_context self)
 {
+  bool idata;
   int more;
   uint32_t i;
 
+  idata = false;
   for(i = more = 0; i < (*conn)->n; i++)
     if (mk_recv_msg(&(*conn)->chan[i], false) == 1) {
       more = 1;
+      if ((*conn)->chan[i].imu && (*conn)->chan[i].msg[0] == 'I') {
+        gettimeofday(&(*conn)->imu, NULL);
+        idata = true;
+      }
+
       mk_comm_recv_msg(&(*conn)->chan[i],
                        imu_calibration, imu_filter, sensor_time,
                        imu, mag, rotor_data, battery, simulate_battery, imu_temp,
-                       self);
+                       *capture, self);
+    }
+
+  /* send setpoints waiting for imu data */
+  if (idata)
+    for(i = 0; i < (*conn)->n; i++) {
+      if (!(*conn)->chan[i].sync.len) continue;
+      if (!mk_flush_msg(*conn, &(*conn)->chan[i]))
+        mk_sync_delay(&(*conn)->chan[i], &(*conn)->imu);
     }
 
   return more ? rotorcraft_recv : rotorcraft_poll;
@@ -243,6 +260,7 @@ mk_comm_recv_msg(struct mk_channel_s *chan,
                  const rotorcraft_imu *imu, const rotorcraft_mag *mag,
                  rotorcraft_ids_rotor_data_s *rotor_data,
                  rotorcraft_ids_battery_s *battery, bool simulate_battery, double *imu_temp,
+                 rotorcraft_capture_s *capture,
                  const genom_context self)
 {
   struct timeval tv;
@@ -269,6 +287,7 @@ mk_comm_recv_msg(struct mk_channel_s *chan,
         mk_get_ts(
           seq, tv, sensor_time->rate.imu, &sensor_time->imu,
           &idata->ts, &sensor_time->measured_rate.imu);
+        rc_capture_msg(capture, chan->msg, len, 2, 0, &idata->ts, tv);
 
         v16 = ((int16_t)(*msg++) << 8);
         v16 |= ((uint16_t)(*msg++) << 0);
@@ -337,6 +356,7 @@ mk_comm_recv_msg(struct mk_channel_s *chan,
         mk_get_ts(
           seq, tv, sensor_time->rate.mag, &sensor_time->mag,
           &mdata->ts, &sensor_time->measured_rate.mag);
+        rc_capture_msg(capture, chan->msg, len, 2, 0, &mdata->ts, tv);
 
         v16 = ((int16_t)(*msg++) << 8);
         v16 |= ((uint16_t)(*msg++) << 0);
@@ -384,6 +404,8 @@ mk_comm_recv_msg(struct mk_channel_s *chan,
         mk_get_ts(
           seq, tv, sensor_time->rate.motor, &sensor_time->motor[id],
           &rotor_data[id].state.ts, &sensor_time->measured_rate.motor);
+        rc_capture_msg(
+          capture, chan->msg, len, 3, id, &rotor_data[id].state.ts, tv);
 
         rotor_data[id].state.emerg = !!(state & 0x80);
         rotor_data[id].state.spinning = !!(state & 0x20);
@@ -414,6 +436,7 @@ mk_comm_recv_msg(struct mk_channel_s *chan,
 
         u16 = ((uint16_t)(*msg++) << 8);
         u16 |= ((uint16_t)(*msg++) << 0);
+        rc_capture_msg(capture, chan->msg, len, 2, 0, NULL, tv);
 
         if (simulate_battery) {
         if (battery->level == battery->max){
@@ -478,10 +501,14 @@ mk_comm_recv_msg(struct mk_channel_s *chan,
  * Throws rotorcraft_e_sys.
  */
 genom_event
-mk_comm_stop(rotorcraft_conn_s **conn, const genom_context self)
+mk_comm_stop(rotorcraft_conn_s **conn, rotorcraft_capture_s **capture,
+             const genom_context self)
 {
   uint32_t i;
 
+  /* no more data to capture */
+  rc_capture_stop(capture, self);
+
   /* stop all streaming */
   mk_set_sensor_rate(
     &(struct rotorcraft_ids_sensor_time_s_rate_s){ 0 }, *conn,
@@ -741,6 +768,11 @@ mk_connect_chan(const char serial[64], uint32_t baud, struct mk_channel_s *chan,
   chan->st_ino = sb.st_ino;
   chan->r = chan->w = 0;
   chan->start = chan->escape = false;
+  chan->sp.cmd = 0;
+  chan->sync.len = 0;
+  chan->sync.phase = chan->sync.jitter = 0.;
+  chan->sync.late = 0;
+  chan->estop = 0.;
 
   /* check endpoint */
   while (mk_recv_msg(chan, true) == 1); /* flush buffer */
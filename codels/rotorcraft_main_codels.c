@@ -27,6 +27,23 @@
 #include "codels.h"
 
 
+static void	mk_velocity_estimate(
+                        const rotorcraft_ids_rotor_data_s *rotor_data,
+                        const struct timeval *tv,
+                        rotorcraft_ids_velocity_estimator_s *estimator);
+static void	rc_main_log_rec(const rotorcraft_ids_battery_s *battery,
+                        double imu_temp,
+                        const rotorcraft_ids_rotor_data_s *rotor_data,
+                        const rotorcraft_ids_sensor_time_s_rate_s *measured_rate,
+                        const or_rotorcraft_output *rdata,
+                        const or_pose_estimator_state *idata,
+                        const or_pose_estimator_state *mdata,
+                        const rotorcraft_ids_imu_filter_s *imu_filter,
+                        const struct timeval *tv,
+                        rotorcraft_ids_publish_time_s *t,
+                        struct rc_log_rec *r);
+
+
 /* --- Task main -------------------------------------------------------- */
 
 /** Codel mk_main_init of task main.
@@ -46,7 +63,11 @@ mk_main_init(rotorcraft_ids *ids, const rotorcraft_imu *imu,
 
   ids->conn = malloc(sizeof(*ids->conn));
   if (!ids->conn) return mk_e_sys_error(NULL, self);
-  *ids->conn = (rotorcraft_conn_s){ .chan = NULL, .n = 0 };
+  *ids->conn = (rotorcraft_conn_s){ .chan = NULL, .n = 0, .imu = { 0 } };
+  ids->conn->estop = malloc(sizeof(*ids->conn->estop));
+  if (!ids->conn->estop) return mk_e_sys_error(NULL, self);
+  pthread_mutex_init(&ids->conn->estop->lock, NULL);
+  ids->conn->estop->latched = false;
 
   ids->sensor_time = (rotorcraft_ids_sensor_time_s){
     .rate = { .imu = 1000., .mag = 100., .motor = 100., .battery = 1. }
@@ -71,6 +92,8 @@ mk_main_init(rotorcraft_ids *ids, const rotorcraft_imu *imu,
 
   ids->publish_time = (rotorcraft_ids_publish_time_s){ 0 };
   ids->log_time = (rotorcraft_ids_publish_time_s){ 0 } ;
+  ids->recorder_time = (rotorcraft_ids_publish_time_s){ 0 };
+  ids->stream_time = (rotorcraft_ids_publish_time_s){ 0 };
 
   ids->imu_temp = nan("");
 
@@ -126,25 +149,64 @@ mk_main_init(rotorcraft_ids *ids, const rotorcraft_imu *imu,
 
   ids->servo.timeout = 30.;
   ids->servo.ramp = 3.;
+  ids->servo.keepalive = 0.;
+  ids->servo.imu_sync = false;
+
+  ids->input_time = (rotorcraft_ids_input_time_s){
+    .ts = { .sec = 0, .nsec = 0 },
+    .rate = 0., .age = 0., .max_age = 0., .fresh = 0, .stale = 0
+  };
+
+  ids->velocity_estimator.enable = false;
+  ids->velocity_estimator.tau = 0.03;
+  ids->velocity_estimator.mstddev = 5.;
+  ids->velocity_estimator.pstddev = 50.;
+  for(i = 0; i < or_rotorcraft_max_rotors; i++) {
+    ids->velocity_estimator.mts[i] = (or_time_ts){ .sec = 0, .nsec = 0 };
+    ids->velocity_estimator.mw[i] = ids->velocity_estimator.w[i] = 0.;
+    ids->velocity_estimator.mvar[i] = ids->velocity_estimator.wstddev[i] = 0.;
+  }
+  ids->velocity_estimator.ts = (or_time_ts){ .sec = 0, .nsec = 0 };
 
   /* init logging */
   ids->log = malloc(sizeof(*ids->log));
   if (!ids->log) abort();
   *ids->log = (rotorcraft_log_s){
-    .fd = -1,
-    .req = {
-      .aio_fildes = -1,
-      .aio_offset = 0,
-      .aio_buf = ids->log->buffer,
-      .aio_nbytes = 0,
-      .aio_reqprio = 0,
-      .aio_sigevent = { .sigev_notify = SIGEV_NONE },
-      .aio_lio_opcode = LIO_NOP
-    },
-    .pending = false, .skipped = false,
-    .decimation = 1, .missed = 0, .total = 0
+    .fd = -1, .path = "",
+    .io = { .fd = -1, .pending = false, .written = 0, .allocated = 0 },
+    .skipped = false,
+    .decimation = 1, .missed = 0, .total = 0,
+    .binary = false, .compress = false, .columns = RC_LOG_ALL,
+    .hdr = { NULL }, .writer = NULL,
+    .buf = NULL, .nbuf = 0, .r = 0, .w = 0, .bufsize = 0,
+    .cfg = {
+      .size = 65536, .count = 4, .period = 0.1, .prealloc = 64 << 20,
+      .rotate_size = 0, .rotate_period = 0.
+    }
+  };
+
+  /* init flight recorder */
+  if (rc_recorder_init(&ids->recorder, 10., "/tmp/rotorcraft-recorder"))
+    abort();
+
+  /* init telemetry stream */
+  ids->stream = malloc(sizeof(*ids->stream));
+  if (!ids->stream) abort();
+  *ids->stream = (rotorcraft_stream_s){
+    .fd = -1, .active = false, .decimation = 1, .columns = RC_LOG_ALL,
+    .addrlen = 0, .missed = 0, .total = 0
+  };
+
+  /* init raw sensor capture */
+  ids->capture = malloc(sizeof(*ids->capture));
+  if (!ids->capture) abort();
+  *ids->capture = (rotorcraft_capture_s){
+    .total = 0, .missed = 0, .writer = NULL
   };
 
+  /* imu calibration is allocated by calibrate_imu or calibrate_mag */
+  ids->calibration = NULL;
+
   *imu->data(self) = *mag->data(self) = (or_pose_estimator_state){
     .ts = { .sec = tv.tv_sec, .nsec = tv.tv_usec * 1000 },
     .intrinsic = true,
@@ -183,6 +245,7 @@ mk_main_perm(const rotorcraft_conn_s *conn,
              rotorcraft_ids_sensor_time_s *sensor_time,
              rotorcraft_ids_publish_time_s *publish_time,
              bool *imu_calibration_updated,
+             rotorcraft_ids_velocity_estimator_s *velocity_estimator,
              const or_rotorcraft_rotor_measure *rotor_measure,
              const rotorcraft_imu *imu, const rotorcraft_mag *mag,
              const genom_context self)
@@ -262,12 +325,25 @@ mk_main_perm(const rotorcraft_conn_s *conn,
       rdata->rotor._length = i + 1;
   }
 
-  for(i = 0; i < or_rotorcraft_max_rotors; i++) {
-    if (rc_neqexts(publish_time->mstate[i], rotor_data[i].state.ts)) {
-      rotor_measure->write(self);
-      for(; i < or_rotorcraft_max_rotors; i++)
-        publish_time->mstate[i] = rotor_data[i].state.ts;
-      break;
+  if (velocity_estimator->enable) {
+    /* publish predicted velocities at each period */
+    mk_velocity_estimate(rotor_data, &tv, velocity_estimator);
+    for(i = 0; i < or_rotorcraft_max_rotors; i++) {
+      publish_time->mstate[i] = rotor_data[i].state.ts;
+      if (rotor_data[i].state.disabled) continue;
+
+      rdata->rotor._buffer[i].ts = velocity_estimator->ts;
+      rdata->rotor._buffer[i].velocity = velocity_estimator->w[i];
+    }
+    rotor_measure->write(self);
+  } else {
+    for(i = 0; i < or_rotorcraft_max_rotors; i++) {
+      if (rc_neqexts(publish_time->mstate[i], rotor_data[i].state.ts)) {
+        rotor_measure->write(self);
+        for(; i < or_rotorcraft_max_rotors; i++)
+          publish_time->mstate[i] = rotor_data[i].state.ts;
+        break;
+      }
     }
   }
 
@@ -305,6 +381,138 @@ mk_main_perm(const rotorcraft_conn_s *conn,
 }
 
 
+/* --- mk_velocity_estimate ----------------------------------------------- */
+
+/* Motor velocities prediction at time tv, assuming a first order response to
+ * the commanded velocity. Measurements are merged with a scalar Kalman
+ * filter at the measurement time. */
+
+static void
+mk_velocity_estimate(const rotorcraft_ids_rotor_data_s *rotor_data,
+                     const struct timeval *tv,
+                     rotorcraft_ids_velocity_estimator_s *estimator)
+{
+  const double r = estimator->mstddev * estimator->mstddev;
+  const double q = estimator->pstddev * estimator->pstddev;
+  double wd, w, var, dt, a, k;
+  or_time_ts mts;
+  size_t i;
+
+  estimator->ts.sec = tv->tv_sec;
+  estimator->ts.nsec = tv->tv_usec * 1000;
+
+  for(i = 0; i < or_rotorcraft_max_rotors; i++) {
+    const or_rotorcraft_rotor_state *state = &rotor_data[i].state;
+
+    if (state->disabled || !state->spinning || isnan(state->velocity)) {
+      estimator->mts[i] = state->ts;
+      estimator->mw[i] = estimator->w[i] =
+        isnan(state->velocity) ? 0. : state->velocity;
+      estimator->mvar[i] = estimator->wstddev[i] = 0.;
+      continue;
+    }
+
+    /* hold the estimate without a velocity command */
+    wd = rotor_data[i].wd != 0. ? rotor_data[i].wd : estimator->mw[i];
+
+    /* new measurement */
+    mts = estimator->mts[i];
+    if (rc_neqexts(estimator->mts[i], state->ts)) {
+      dt = state->ts.sec - mts.sec + 1e-9 * ((double)state->ts.nsec - mts.nsec);
+
+      if (dt <= 0. || dt > 1. || estimator->mvar[i] <= 0.) {
+        estimator->mw[i] = state->velocity;
+        estimator->mvar[i] = r;
+      } else {
+        a = estimator->tau > 0. ? exp(-dt / estimator->tau) : 0.;
+        w = wd + (estimator->mw[i] - wd) * a;
+        var = estimator->mvar[i] * a * a + q * dt;
+
+        k = var / (var + r);
+        estimator->mw[i] = w + k * (state->velocity - w);
+        estimator->mvar[i] = (1. - k) * var;
+      }
+    }
+
+    /* prediction */
+    dt = tv->tv_sec - estimator->mts[i].sec +
+      1e-6 * tv->tv_usec - 1e-9 * estimator->mts[i].nsec;
+    if (dt < 0.) dt = 0.;
+    a = estimator->tau > 0. ? exp(-dt / estimator->tau) : 0.;
+
+    estimator->w[i] = wd + (estimator->mw[i] - wd) * a;
+    estimator->wstddev[i] = sqrt(estimator->mvar[i] * a * a + q * dt);
+  }
+}
+
+
+/* Build a log record with data updated since the previous record, as
+ * recorded in t. */
+
+static void
+rc_main_log_rec(const rotorcraft_ids_battery_s *battery, double imu_temp,
+                const rotorcraft_ids_rotor_data_s *rotor_data,
+                const rotorcraft_ids_sensor_time_s_rate_s *measured_rate,
+                const or_rotorcraft_output *rdata,
+                const or_pose_estimator_state *idata,
+                const or_pose_estimator_state *mdata,
+                const rotorcraft_ids_imu_filter_s *imu_filter,
+                const struct timeval *tv, rotorcraft_ids_publish_time_s *t,
+                struct rc_log_rec *r)
+{
+  int i;
+
+  *r = (struct rc_log_rec){
+    .sec = tv->tv_sec, .nsec = tv->tv_usec * 1000, .present = 0,
+    .rate = { measured_rate->imu, measured_rate->mag, measured_rate->motor }
+  };
+
+  if (rc_neqexts(t->battery, battery->ts)) {
+    r->present |= rc_log_has_bat;
+    r->bat = battery->level;
+  }
+
+  if (rc_neqexts(t->imu, idata->ts)) {
+    r->present |= rc_log_has_imu;
+    r->imu[0] = imu_temp;
+    r->imu[1] = idata->avel._value.wx;
+    r->imu[2] = idata->avel._value.wy;
+    r->imu[3] = idata->avel._value.wz;
+    r->imu[4] = imu_filter->g[0];
+    r->imu[5] = imu_filter->g[1];
+    r->imu[6] = imu_filter->g[2];
+    r->imu[7] = idata->acc._value.ax;
+    r->imu[8] = idata->acc._value.ay;
+    r->imu[9] = idata->acc._value.az;
+    r->imu[10] = imu_filter->a[0];
+    r->imu[11] = imu_filter->a[1];
+    r->imu[12] = imu_filter->a[2];
+  }
+
+  if (rc_neqexts(t->mag, mdata->ts)) {
+    r->present |= rc_log_has_mag;
+    r->mag[0] = mdata->att._value.qx;
+    r->mag[1] = mdata->att._value.qy;
+    r->mag[2] = mdata->att._value.qz;
+    r->mag[3] = imu_filter->m[0];
+    r->mag[4] = imu_filter->m[1];
+    r->mag[5] = imu_filter->m[2];
+  }
+
+  for(i = 0; i < or_rotorcraft_max_rotors; i++) {
+    if (rc_neqexts(t->mwd[i], rotor_data[i].ts)) {
+      r->present |= rc_log_has_cmd(i);
+      r->cmd[i] = rotor_data[i].wd;
+    }
+    if (rc_neqexts(t->mstate[i], rdata->rotor._buffer[i].ts)) {
+      r->present |= rc_log_has_meas(i);
+      r->meas[i] = rdata->rotor._buffer[i].velocity;
+    }
+    r->clk[i] = rotor_data[i].clkrate;
+  }
+}
+
+
 /** Codel rc_main_log of task main.
  *
  * Triggered by rotorcraft_log.
@@ -318,119 +526,93 @@ rc_main_log(const rotorcraft_ids_battery_s *battery, double imu_temp,
             const rotorcraft_imu *imu, const rotorcraft_mag *mag,
             const rotorcraft_ids_imu_filter_s *imu_filter,
             rotorcraft_ids_publish_time_s *log_time,
-            rotorcraft_log_s **log, const genom_context self)
+            rotorcraft_ids_publish_time_s *recorder_time,
+            rotorcraft_ids_publish_time_s *stream_time,
+            rotorcraft_log_s **log, rotorcraft_recorder_s **recorder,
+            rotorcraft_stream_s **stream, const genom_context self)
 {
   or_pose_estimator_state *idata = imu->data(self);
   or_pose_estimator_state *mdata = mag->data(self);
   or_rotorcraft_output *rdata = rotor_measure->data(self);
+  struct rc_log_buf *b;
+  struct rc_log_rec r, *rec;
   struct timeval tv;
-  int i;
+  char *p;
+
+  gettimeofday(&tv, NULL);
+
+  /* flight recorder */
+  if (rc_recorder_enabled(*recorder)) {
+    rc_main_log_rec(battery, imu_temp, rotor_data, measured_rate, rdata,
+                    idata, mdata, imu_filter, &tv, recorder_time, &r);
+    rc_recorder_push(*recorder, &r);
+  }
 
-  if ((*log)->req.aio_fildes < 0) return rotorcraft_pause_main;
+  /* telemetry stream */
+  if ((*stream)->active && !((*stream)->total++ % (*stream)->decimation)) {
+    rc_main_log_rec(battery, imu_temp, rotor_data, measured_rate, rdata,
+                    idata, mdata, imu_filter, &tv, stream_time, &r);
+    rc_stream_send(*stream, &r);
+  }
+
+  if ((*log)->io.fd < 0) return rotorcraft_pause_main;
 
   (*log)->total++;
   if ((*log)->total % (*log)->decimation) return rotorcraft_pause_main;
 
-  if ((*log)->pending) {
-    switch (aio_error(&(*log)->req)) {
-      case EINPROGRESS:
-        (*log)->skipped = true;
-        (*log)->missed++;
-        return rotorcraft_pause_main;
-    }
-
-    (*log)->pending = false;
-    if (aio_return(&(*log)->req) <= 0) {
+  /* hand over a snapshot to the writer thread, which does the formatting,
+   * or skip it if the ring is full */
+  if ((*log)->writer) {
+    if (rc_log_writer_error(*log)) {
+      /* only stop logging here: the writer thread is joined and the file
+       * closed by log_stop or the next log, outside of the main task */
       warn("log");
-      mk_log_stop(log, self);
+      (*log)->io.fd = -1;
+      return rotorcraft_pause_main;
+    }
+    rec = rc_log_writer_slot(*log);
+    if (!rec) {
+      (*log)->skipped = true;
+      (*log)->missed++;
       return rotorcraft_pause_main;
     }
-  }
-
-  gettimeofday(&tv, NULL);
 
-  /* build log buffer */
-  const char * const end = &(*log)->buffer[sizeof((*log)->buffer)];
-  char *p = (*log)->buffer;
-
-#define xprint(...)                                                     \
-  do {                                                                  \
-    int s = snprintf(p, end-p, __VA_ARGS__);                            \
-    p += s;                                                             \
-    if (s < 0 || p >= end) goto full;                                   \
-  } while(0)
-
-  if ((*log)->skipped) xprint("\n");
-  /* ts */
-  xprint("%"PRIu64".%09d ", (uint64_t)tv.tv_sec, (uint32_t)tv.tv_usec*1000);
-
-  /* rate */
-  xprint(" %g %g %g ",
-         measured_rate->imu, measured_rate->mag, measured_rate->motor);
-
-  /* bat */
-  if (rc_neqexts(log_time->battery, battery->ts))
-    xprint(" %g ", battery->level);
-  else
-    xprint(" - ");
-
-  /* imu */
-  if (rc_neqexts(log_time->imu, idata->ts))
-    xprint(
-      " %g  %g %g %g  %g %g %g  %g %g %g  %g %g %g ",
-      imu_temp,
-      idata->avel._value.wx, idata->avel._value.wy, idata->avel._value.wz,
-      imu_filter->g[0], imu_filter->g[1], imu_filter->g[2],
-      idata->acc._value.ax, idata->acc._value.ay, idata->acc._value.az,
-      imu_filter->a[0], imu_filter->a[1], imu_filter->a[2]);
-  else
-    xprint(" -  - - -  - - -  - - -  - - - ");
-
-  /* mag */
-  if (rc_neqexts(log_time->mag, mdata->ts))
-    xprint(
-      " %g %g %g  %g %g %g ",
-      mdata->att._value.qx, mdata->att._value.qy, mdata->att._value.qz,
-      imu_filter->m[0], imu_filter->m[1], imu_filter->m[2]);
-  else
-    xprint(" - - -  - - - ");
-
-  /* cmd */
-  for(i = 0; i < or_rotorcraft_max_rotors; i++) {
-    if (rc_neqexts(log_time->mwd[i], rotor_data[i].ts))
-      xprint(" %g", rotor_data[i].wd);
-    else
-      xprint(" -");
+    rc_main_log_rec(battery, imu_temp, rotor_data, measured_rate, rdata,
+                    idata, mdata, imu_filter, &tv, log_time, rec);
+    rc_log_writer_push(*log);
+    (*log)->skipped = false;
+    return rotorcraft_pause_main;
   }
 
-  /* meas */
-  for(i = 0; i < or_rotorcraft_max_rotors; i++) {
-    if (rc_neqexts(log_time->mstate[i], rdata->rotor._buffer[i].ts))
-      xprint(" %g", rdata->rotor._buffer[i].velocity);
-    else
-      xprint(" -");
-  }
+  /* make room for one binary record, or skip it if all buffers are full */
+  if (rc_log_reap(*log)) goto err;
 
-  /* clk */
-  for(i = 0; i < or_rotorcraft_max_rotors; i++)
-    xprint(" %d", rotor_data[i].clkrate);
+  b = &(*log)->buf[(*log)->w];
+  if ((*log)->bufsize - b->len < rc_log_maxrec) {
+    if (rc_log_next(*log)) {
+      (*log)->missed++;
+      return rotorcraft_pause_main;
+    }
+    b = &(*log)->buf[(*log)->w];
+  }
+  p = b->data + b->len;
+  if (!b->len) b->tv = tv;
 
-  xprint("\n");
-#undef xprint
+  rc_main_log_rec(battery, imu_temp, rotor_data, measured_rate, rdata,
+                  idata, mdata, imu_filter, &tv, log_time, &r);
 
-  (*log)->req.aio_nbytes = p - (*log)->buffer;
-  if (aio_write(&(*log)->req)) {
-    warn("log");
-    goto err;
-  }
+  p += rc_log_binary(&r, (*log)->columns, p);
+  b->len = p - b->data;
 
-  (*log)->pending = true;
-  (*log)->skipped = false;
+  /* write full buffers, or buffers older than cfg.period */
+  if (tv.tv_sec - b->tv.tv_sec + 1e-6 * (tv.tv_usec - b->tv.tv_usec) >=
+      (*log)->cfg.period)
+    rc_log_next(*log);
+  if (rc_log_submit(*log)) goto err;
 
   return rotorcraft_pause_main;
-full:
-  warnx("log buffer overflow");
 err:
+  warn("log");
   mk_log_stop(log, self);
   return rotorcraft_pause_main;
 }
@@ -442,10 +624,25 @@ err:
  * Yields to rotorcraft_ether.
  */
 genom_event
-mk_main_stop(rotorcraft_log_s **log, const genom_context self)
+mk_main_stop(rotorcraft_log_s **log, rotorcraft_recorder_s **recorder,
+             rotorcraft_stream_s **stream, const genom_context self)
 {
+  int i;
+
+  rc_recorder_fini(recorder);
+
+  rc_stream_stop(stream, self);
+  free(*stream);
+
   mk_log_stop(log, self);
-  if (*log) free(*log);
+  if (*log) {
+    for(i = 0; i < RC_LOG_NHDR; i++) free((*log)->hdr[i]);
+    if ((*log)->buf) {
+      free((*log)->buf[0].data);
+      free((*log)->buf);
+    }
+    free(*log);
+  }
 
   return rotorcraft_ether;
 }
@@ -462,13 +659,14 @@ mk_main_stop(rotorcraft_log_s **log, const genom_context self)
 genom_event
 mk_calibrate_imu_start(const rotorcraft_ids_calibration_param_s *calib_param,
                        double tstill, uint16_t nposes,
+                       rotorcraft_calibration_s **calibration,
                        const genom_context self)
 {
   uint32_t sps;
   int s;
 
   sps = 1000/rotorcraft_control_period_ms;
-  s = mk_calibration_init(tstill * sps, nposes, sps,
+  s = mk_calibration_init(calibration, tstill * sps, nposes, sps,
                           calib_param->motion_tolerance);
   if (s) {
     errno = s;
@@ -489,13 +687,14 @@ genom_event
 mk_calibrate_imu_collect(const char path[64], double imu_temp,
                          const rotorcraft_imu *imu,
                          const rotorcraft_mag *mag,
+                         rotorcraft_calibration_s **calibration,
                          const genom_context self)
 {
   int32_t still;
   int s;
 
   s = mk_calibration_collect(
-    imu_temp, imu->data(self), mag->data(self), &still);
+    *calibration, imu_temp, imu->data(self), mag->data(self), &still);
   switch(s) {
     case 0: break;
 
@@ -508,8 +707,9 @@ mk_calibrate_imu_collect(const char path[64], double imu_temp,
 
     default:
       warnx("calibration aborted");
-      if (*path) mk_calibration_log(path);
-      mk_calibration_fini(NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+      if (*path) mk_calibration_log(*calibration, path);
+      mk_calibration_fini(
+        calibration, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
       errno = s;
       return mk_e_sys_error("calibration", self);
   }
@@ -521,46 +721,53 @@ mk_calibrate_imu_collect(const char path[64], double imu_temp,
 /** Codel mk_calibrate_imu_main of activity calibrate_imu.
  *
  * Triggered by rotorcraft_main.
- * Yields to rotorcraft_ether.
+ * Yields to rotorcraft_pause_solve.
  * Throws rotorcraft_e_sys, rotorcraft_e_connection.
  */
 genom_event
 mk_calibrate_imu_main(const char path[64],
                       const rotorcraft_ids_sensor_time_s_rate_s *rate,
-                      rotorcraft_ids_imu_calibration_s *imu_calibration,
-                      bool *imu_calibration_updated,
+                      const rotorcraft_ids_imu_calibration_s *imu_calibration,
+                      rotorcraft_calibration_s **calibration,
                       const genom_context self)
 {
-  double maxa[3], maxw[3], avga, avgw;
   int s;
 
-  s = mk_calibration_acc(imu_calibration->ascale, imu_calibration->abias);
+  s = mk_calibration_solve(
+    *calibration, path, true, rate->mag > 0., imu_calibration);
   if (s) {
-    warnx("accelerometer calibration failed");
-    goto fail;
+    mk_calibration_fini(
+      calibration, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    errno = s;
+    return mk_e_sys_error("calibration", self);
   }
 
-  s = mk_calibration_gyr(imu_calibration->gscale, imu_calibration->gbias);
-  if (s) {
-    warnx("gyroscope calibration failed");
-    goto fail;
-  }
+  return rotorcraft_pause_solve;
+}
 
-  if (rate->mag > 0.) {
-    s = mk_calibration_mag(imu_calibration->mscale, imu_calibration->mbias);
-    if (s) {
-      warnx("magnetometer calibration failed");
-      goto fail;
-    }
-  }
+/** Codel mk_calibrate_imu_solve of activity calibrate_imu.
+ *
+ * Triggered by rotorcraft_solve.
+ * Yields to rotorcraft_pause_solve, rotorcraft_ether.
+ * Throws rotorcraft_e_sys, rotorcraft_e_connection.
+ */
+genom_event
+mk_calibrate_imu_solve(rotorcraft_ids_imu_calibration_s *imu_calibration,
+                       bool *imu_calibration_updated,
+                       rotorcraft_calibration_s **calibration,
+                       const genom_context self)
+{
+  double maxa[3], maxw[3], avga, avgw;
+  int s;
 
-  if (*path) mk_calibration_log(path);
+  s = mk_calibration_result(
+    calibration, imu_calibration, maxa, maxw, &avga, &avgw);
+  if (s == EAGAIN) return rotorcraft_pause_solve;
+  if (s) {
+    errno = s;
+    return mk_e_sys_error("calibration", self);
+  }
 
-  mk_calibration_fini(
-    imu_calibration->astddev,
-    imu_calibration->gstddev,
-    rate->mag > 0. ? imu_calibration->mstddev : NULL,
-    maxa, maxw, &imu_calibration->temp, &avga, &avgw);
   warnx("calibration max acceleration: "
         "x %.2fm/s², y %.2fm/s², z %.2fm/s²", maxa[0], maxa[1], maxa[2]);
   warnx("calibration avg acceleration: %gm/s²", avga);
@@ -571,12 +778,24 @@ mk_calibrate_imu_main(const char path[64],
 
   *imu_calibration_updated = true;
   return rotorcraft_ether;
+}
 
-fail:
-  if (*path) mk_calibration_log(path);
-  mk_calibration_fini(NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-  errno = s;
-  return mk_e_sys_error("calibration", self);
+/** Codel mk_calibrate_imu_stop of activity calibrate_imu.
+ *
+ * Triggered by rotorcraft_stop.
+ * Yields to rotorcraft_pause_stop, rotorcraft_ether.
+ * Throws rotorcraft_e_sys, rotorcraft_e_connection.
+ */
+genom_event
+mk_calibrate_imu_stop(rotorcraft_calibration_s **calibration,
+                      const genom_context self)
+{
+  (void)self; /* -Wunused-parameter */
+
+  /* wait for the solver to stop without blocking the task */
+  if (mk_calibration_cancel(calibration) == EAGAIN)
+    return rotorcraft_pause_stop;
+  return rotorcraft_ether;
 }
 
 
@@ -590,9 +809,10 @@ fail:
  */
 genom_event
 mk_calibrate_mag_start(const rotorcraft_ids_calibration_param_s *calib_param,
-                       double tstill, const genom_context self)
+                       double tstill, rotorcraft_calibration_s **calibration,
+                       const genom_context self)
 {
-  return mk_calibrate_imu_start(calib_param, tstill, 2, self);
+  return mk_calibrate_imu_start(calib_param, tstill, 2, calibration, self);
 }
 
 /** Codel mk_calibrate_imu_collect of activity calibrate_mag.
@@ -607,37 +827,63 @@ mk_calibrate_mag_start(const rotorcraft_ids_calibration_param_s *calib_param,
 /** Codel mk_calibrate_mag_main of activity calibrate_mag.
  *
  * Triggered by rotorcraft_main.
- * Yields to rotorcraft_ether.
+ * Yields to rotorcraft_pause_solve.
  * Throws rotorcraft_e_sys, rotorcraft_e_connection.
  */
 genom_event
 mk_calibrate_mag_main(const char path[64],
-                      rotorcraft_ids_imu_calibration_s *imu_calibration,
-                      bool *imu_calibration_updated,
+                      const rotorcraft_ids_imu_calibration_s *imu_calibration,
+                      rotorcraft_calibration_s **calibration,
                       const genom_context self)
 {
   int s;
 
-  s = mk_calibration_mag(imu_calibration->mscale, imu_calibration->mbias);
+  s = mk_calibration_solve(
+    *calibration, path, false, true, imu_calibration);
   if (s) {
-    warnx("magnetometer calibration failed");
-    goto fail;
+    mk_calibration_fini(
+      calibration, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    errno = s;
+    return mk_e_sys_error("calibration", self);
   }
 
-  if (*path) mk_calibration_log(path);
+  return rotorcraft_pause_solve;
+}
 
-  mk_calibration_fini(
-    NULL, NULL, imu_calibration->mstddev, NULL, NULL, NULL, NULL, NULL);
+/** Codel mk_calibrate_mag_solve of activity calibrate_mag.
+ *
+ * Triggered by rotorcraft_solve.
+ * Yields to rotorcraft_pause_solve, rotorcraft_ether.
+ * Throws rotorcraft_e_sys, rotorcraft_e_connection.
+ */
+genom_event
+mk_calibrate_mag_solve(rotorcraft_ids_imu_calibration_s *imu_calibration,
+                       bool *imu_calibration_updated,
+                       rotorcraft_calibration_s **calibration,
+                       const genom_context self)
+{
+  int s;
+
+  s = mk_calibration_result(
+    calibration, imu_calibration, NULL, NULL, NULL, NULL);
+  if (s == EAGAIN) return rotorcraft_pause_solve;
+  if (s) {
+    errno = s;
+    return mk_e_sys_error("calibration", self);
+  }
 
   *imu_calibration_updated = true;
   return rotorcraft_ether;
-
-fail:
-  mk_calibration_fini(NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
-  errno = s;
-  return mk_e_sys_error("calibration", self);
 }
 
+/** Codel mk_calibrate_imu_stop of activity calibrate_mag.
+ *
+ * Triggered by rotorcraft_stop.
+ * Yields to rotorcraft_pause_stop, rotorcraft_ether.
+ * Throws rotorcraft_e_sys, rotorcraft_e_connection.
+ */
+/* already defined in service calibrate_imu */
+
 
 /* --- Activity set_zero ------------------------------------------------ */
 
@@ -833,6 +1079,9 @@ mk_start_start(const rotorcraft_conn_s *conn,
     if (rotor_data[i].state.spinning) return rotorcraft_e_started(self);
   }
 
+  /* setpoints are allowed again after an emergency stop */
+  mk_estop_clear(conn);
+
   *timeout = servo->timeout * 1e3 / rotorcraft_control_period_ms;
   *state = 0;
   for(i = 0; i < or_rotorcraft_max_rotors; i++) {
@@ -977,11 +1226,26 @@ mk_start_stop(const rotorcraft_conn_s *conn,
  *        rotorcraft_e_input.
  */
 genom_event
-mk_servo_start(double *scale, const genom_context self)
+mk_servo_start(const rotorcraft_conn_s *conn, double *scale, bool *cached,
+               rotorcraft_ids_input_time_s *input_time,
+               const genom_context self)
 {
   (void)self;
+  uint32_t i;
+
+  /* forget previous setpoints, so that the first ones are always sent */
+  if (conn)
+    for(i = 0; i < conn->n; i++) {
+      conn->chan[i].sp.cmd = 0;
+      conn->chan[i].sync.len = 0;
+    }
 
   *scale = 0.;
+  *cached = false;
+  *input_time = (rotorcraft_ids_input_time_s){
+    .ts = { .sec = 0, .nsec = 0 },
+    .rate = 0., .age = 0., .max_age = 0., .fresh = 0, .stale = 0
+  };
   return rotorcraft_main;
 }
 
@@ -999,32 +1263,52 @@ mk_servo_main(const rotorcraft_conn_s *conn,
               rotorcraft_ids_rotor_data_s rotor_data[8],
               const or_rotorcraft_rotor_input *rotor_input,
               const rotorcraft_ids_servo_s *servo, double *scale,
-              const genom_context self)
+              bool *cached, rotorcraft_ids_input_time_s *input_time,
+              rotorcraft_recorder_s **recorder, const genom_context self)
 {
   or_rotorcraft_input *input_data;
   rotorcraft_e_rate_detail erate;
   struct timeval tv;
   genom_event e;
+  bool fresh, unscaled;
+  double dt;
   size_t i;
 
   if (!conn) return rotorcraft_e_connection(self);
 
   /* update input */
-  if (rotor_input->read(self)) return rotorcraft_e_input(self);
-
-  input_data = rotor_input->data(self);
-  if (!input_data) return rotorcraft_e_input(self);
+  input_data = rotor_input->read(self) ? NULL : rotor_input->data(self);
+  if (!input_data) {
+    rc_recorder_trigger(*recorder, "e_input");
+    return rotorcraft_e_input(self);
+  }
 
-  or_rotorcraft_rotor_control desired = input_data->desired;
+  /* input freshness */
+  fresh = input_data->ts.sec != input_time->ts.sec ||
+    input_data->ts.nsec != input_time->ts.nsec;
+  if (fresh) {
+    dt = input_data->ts.sec - input_time->ts.sec +
+      1e-9 * ((double)input_data->ts.nsec - input_time->ts.nsec);
+    if (input_time->ts.sec && dt > 0.)
+      input_time->rate += 0.1 * (1./dt - input_time->rate);
+    input_time->ts = input_data->ts;
+    input_time->fresh++;
+  } else
+    input_time->stale++;
 
   /* watchdog on input */
   gettimeofday(&tv, NULL);
-  if (tv.tv_sec + 1e-6*tv.tv_usec >
-      0.5 + input_data->ts.sec + 1e-9*input_data->ts.nsec) {
+  input_time->age = tv.tv_sec - input_data->ts.sec +
+    1e-6 * tv.tv_usec - 1e-9 * input_data->ts.nsec;
+  if (input_time->age > input_time->max_age)
+    input_time->max_age = input_time->age;
+
+  if (input_time->age > 0.5) {
 
     *scale -= 2e-3 * rotorcraft_control_period_ms / servo->ramp;
     if (*scale < 0.) {
       mk_stop(conn, rotor_data, self);
+      rc_recorder_trigger(*recorder, "e_input");
       return rotorcraft_e_input(self);
     }
   }
@@ -1042,6 +1326,7 @@ mk_servo_main(const rotorcraft_conn_s *conn,
       warnx("stopped because of low sensor rate");
       mk_stop(conn, rotor_data, self);
       *scale = 0.;
+      rc_recorder_trigger(*recorder, "e_rate");
       return rotorcraft_e_rate(&erate, self);
     }
   }
@@ -1054,6 +1339,7 @@ mk_servo_main(const rotorcraft_conn_s *conn,
       rotorcraft_e_rotor_failure_detail e;
 
       mk_stop(conn, rotor_data, self);
+      rc_recorder_trigger(*recorder, "e_rotor_failure");
       e.id = 1 + i;
       return rotorcraft_e_rotor_failure(&e, self);
     }
@@ -1061,11 +1347,32 @@ mk_servo_main(const rotorcraft_conn_s *conn,
       rotorcraft_e_rotor_stopped_detail s;
 
       mk_stop(conn, rotor_data, self);
+      rc_recorder_trigger(*recorder, "e_rotor_stopped");
       s.id = 1 + i;
       return rotorcraft_e_rotor_stopped(&s, self);
     }
   }
 
+  /* unchanged input and scaling: resend the last setpoints */
+  unscaled = *scale >= 1.;
+  if (!fresh && unscaled && *cached) {
+    switch(input_data->control) {
+      case or_rotorcraft_velocity:
+        if (!mk_resend_setpoint(
+              conn, 'w', rotor_data, input_data->desired._length, servo))
+          return rotorcraft_pause_main;
+        break;
+
+      case or_rotorcraft_throttle:
+        if (!mk_resend_setpoint(
+              conn, 'q', rotor_data, input_data->desired._length, servo))
+          return rotorcraft_pause_main;
+        break;
+    }
+  }
+
+  or_rotorcraft_rotor_control desired = input_data->desired;
+
   /* linear input scaling for the first servo->ramp seconds or in case of
    * emergency */
   if (*scale < 1.) {
@@ -1084,19 +1391,21 @@ mk_servo_main(const rotorcraft_conn_s *conn,
   }
 
   /* send */
+  *cached = false;
   switch(input_data->control) {
     case or_rotorcraft_velocity:
-      e = mk_set_velocity(
-        conn, rotor_data, &desired, self);
+      e = mk_send_velocity(
+        conn, rotor_data, &desired, servo, self);
       if (e) return e;
       break;
 
     case or_rotorcraft_throttle:
-      e = mk_set_throttle(
-        conn, rotor_data, &desired, self);
+      e = mk_send_throttle(
+        conn, rotor_data, &desired, servo, self);
       if (e) return e;
       break;
   }
+  *cached = unscaled;
 
   return rotorcraft_pause_main;
 }
@@ -1118,9 +1427,14 @@ mk_servo_stop(const rotorcraft_conn_s *conn, const genom_context self)
 
   for(i = 0; i < or_rotorcraft_max_rotors; i++) p[i] = 32767;
 
-  for(i = 0; i < conn->n; i++)
+  if (!mk_estop_lock(conn)) return rotorcraft_ether;
+  for(i = 0; i < conn->n; i++) {
+    conn->chan[i].sp.cmd = 0;
+    conn->chan[i].sync.len = 0;
     mk_send_msg(&conn->chan[i],
                 "w%@", p, conn->chan[i].maxid - conn->chan[i].minid + 1);
+  }
+  mk_estop_unlock(conn);
 
   return rotorcraft_ether;
 }
@@ -1143,9 +1457,8 @@ mk_stop(const rotorcraft_conn_s *conn,
   uint32_t i;
 
   /* stop rotors */
-  for(i = 0; i < conn->n; i++)
-    if (mk_send_msg(&conn->chan[i], "x"))
-      warnx("cannot send to %s", conn->chan[i].path);
+  if (mk_estop(conn, NULL))
+    warnx("cannot send stop to all devices");
 
   gettimeofday(&tv, NULL);
   for(i = 0; i < or_rotorcraft_max_rotors; i++) {
@@ -1194,12 +1507,13 @@ rc_log_header(const rotorcraft_ids_imu_calibration_s *imu_calibration,
 
   if (rc_log_sensor_rate(rate, log, self)) goto err;
 
-  s = dprintf((*log)->fd, rc_log_header_fmt "\n");
-  if (s < 0) goto err;
+  if (rc_log_header_columns((*log)->fd, (*log)->binary, (*log)->compress,
+                            (*log)->columns))
+    goto err;
 
 
   /* enable async writes */
-  (*log)->req.aio_fildes = (*log)->fd;
+  rc_log_io_start(*log);
 
   return rotorcraft_ether;
 err:
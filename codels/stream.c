@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include "acrotorcraft.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rotorcraft_c_types.h"
+#include "codels.h"
+
+/* Live telemetry stream: the main task sends log records as datagrams to a
+ * Unix domain or UDP socket. Sends never block and datagrams that cannot be
+ * queued are dropped, so that a slow or absent reader cannot stall the main
+ * task.
+ *
+ * Each datagram contains, in host byte order, the 32 bits length of the rest
+ * of the message, the 32 bits rc_log_column groups and one record in the
+ * binary log format for those groups. */
+
+
+/* --- rc_stream_send ------------------------------------------------------ */
+
+void
+rc_stream_send(rotorcraft_stream_s *stream, const struct rc_log_rec *r)
+{
+  char msg[2 * sizeof(uint32_t) + rc_log_maxrec];
+  uint32_t h[2];
+  size_t len;
+
+  len = rc_log_binary(r, stream->columns, msg + sizeof(h));
+  h[0] = sizeof(h[1]) + len;
+  h[1] = stream->columns;
+  memcpy(msg, h, sizeof(h));
+
+  if (sendto(stream->fd, msg, sizeof(h) + len, MSG_DONTWAIT | MSG_NOSIGNAL,
+             (const struct sockaddr *)&stream->addr, stream->addrlen) < 0)
+    stream->missed++;
+}
+
+
+/* --- Activity stream -------------------------------------------------- */
+
+/** Validation codel rc_stream_open of activity stream.
+ *
+ * Returns genom_ok.
+ * Throws rotorcraft_e_sys, rotorcraft_e_range.
+ */
+genom_event
+rc_stream_open(const char url[64], uint32_t decimation,
+               const char columns[128], rotorcraft_stream_s **stream,
+               const genom_context self)
+{
+  struct addrinfo hints, *ai;
+  struct sockaddr_un *sun;
+  char host[64], *port;
+  uint32_t c;
+  int fd;
+
+  if (rc_log_columns(columns, &c)) return rotorcraft_e_range(self);
+
+  if (!strncmp(url, "unix:", 5)) {
+    sun = (struct sockaddr_un *)&(*stream)->addr;
+    if (!url[5] || strlen(url + 5) >= sizeof(sun->sun_path))
+      return rotorcraft_e_range(self);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return mk_e_sys_error("stream", self);
+
+    rc_stream_stop(stream, self);
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, url + 5);
+    (*stream)->addrlen = sizeof(*sun);
+  } else if (!strncmp(url, "udp:", 4)) {
+    snprintf(host, sizeof(host), "%s", url + 4);
+    port = strrchr(host, ':');
+    if (!port || port == host || !port[1]) return rotorcraft_e_range(self);
+    *port++ = 0;
+
+    hints = (struct addrinfo){
+      .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM
+    };
+    if (getaddrinfo(host, port, &hints, &ai)) return rotorcraft_e_range(self);
+    if (ai->ai_addrlen > sizeof((*stream)->addr)) {
+      freeaddrinfo(ai);
+      return rotorcraft_e_range(self);
+    }
+
+    fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      freeaddrinfo(ai);
+      return mk_e_sys_error("stream", self);
+    }
+
+    rc_stream_stop(stream, self);
+    memcpy(&(*stream)->addr, ai->ai_addr, ai->ai_addrlen);
+    (*stream)->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+  } else
+    return rotorcraft_e_range(self);
+
+  (*stream)->fd = fd;
+  (*stream)->decimation = decimation < 1 ? 1 : decimation;
+  (*stream)->columns = c;
+  (*stream)->missed = 0;
+  (*stream)->total = 0;
+
+  return genom_ok;
+}
+
+
+/** Codel rc_stream_start of activity stream.
+ *
+ * Triggered by rotorcraft_start.
+ * Yields to rotorcraft_ether.
+ */
+genom_event
+rc_stream_start(rotorcraft_stream_s **stream, const genom_context self)
+{
+  (void)self; /* -Wunused-parameter */
+
+  /* records are sent by rc_main_log from now on */
+  (*stream)->active = (*stream)->fd >= 0;
+  return rotorcraft_ether;
+}
+
+
+/* --- Function stream_stop --------------------------------------------- */
+
+/** Codel rc_stream_stop of function stream_stop.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+rc_stream_stop(rotorcraft_stream_s **stream, const genom_context self)
+{
+  (void)self; /* -Wunused-parameter */
+
+  if (!*stream) return genom_ok;
+
+  (*stream)->active = false;
+  if ((*stream)->fd >= 0) close((*stream)->fd);
+  (*stream)->fd = -1;
+
+  return genom_ok;
+}
+
+
+/* --- Function stream_info --------------------------------------------- */
+
+/** Codel rc_stream_info of function stream_info.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+rc_stream_info(const rotorcraft_stream_s *stream, uint32_t *miss,
+               uint32_t *total, const genom_context self)
+{
+  (void)self; /* -Wunused-parameter */
+
+  *miss = *total = 0;
+  if (stream) {
+    *miss = stream->missed;
+    *total = stream->total;
+  }
+  return genom_ok;
+}
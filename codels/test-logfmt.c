@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logfmt.h"
+
+/* Check rc_log_fmtg() against printf("%g") around the values that round to
+ * a power of ten, where the decimal exponent changes, and on random bit
+ * patterns. */
+
+static const char *const boundary[] = {
+  "9.999995", "9.999994999999999", "9.9999950000000001",
+  "9.99995", "9.9999499999999999", "1.000005", "1.0000049999999999",
+  "9.5", "0.5"
+};
+
+static const double regression[] = {
+  99.99994999999999, 99999.94999999999, 9.999995e-08, 9.999995e+25,
+  -9.999995e+25
+};
+
+static int
+check(double x)
+{
+  char ref[64], buf[64];
+
+  snprintf(ref, sizeof(ref), "%g", x);
+  *rc_log_fmtg(buf, x) = 0;
+  if (!strcmp(ref, buf)) return 0;
+
+  warnx("%.17g: \"%s\" instead of \"%s\"", x, buf, ref);
+  return 1;
+}
+
+int
+main()
+{
+  char s[64];
+  double x, y;
+  uint64_t u;
+  size_t i;
+  int j, e, n;
+
+  n = 0;
+  for(i = 0; i < sizeof(regression)/sizeof(*regression); i++)
+    n += check(regression[i]);
+
+  for(i = 0; i < sizeof(boundary)/sizeof(*boundary); i++)
+    for(e = -310; e <= 308; e++) {
+      snprintf(s, sizeof(s), "%se%d", boundary[i], e);
+      x = y = strtod(s, NULL);
+      for(j = 0; j < 32; j++) {
+        n += check(x) + check(-x) + check(y) + check(-y);
+        x = nextafter(x, 0.);
+        y = nextafter(y, INFINITY);
+      }
+    }
+
+  srand48(0);
+  for(i = 0; i < 1000000; i++) {
+    u = (uint64_t)mrand48() << 32 ^ (uint32_t)mrand48();
+    memcpy(&x, &u, sizeof(x));
+    n += check(x);
+  }
+
+  if (n) errx(1, "%d mismatches", n);
+  return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logz.h"
+
+/* Round trip synthetic flight records, laid out like the log with all
+ * columns, through the compressed chunks codec at 1 kHz and 2 kHz, and
+ * report the encoding and decoding throughput and the compression ratio.
+ * The decoded records must be identical to the encoded ones. */
+
+#define nrotors		8
+#define chunk		1024	/* records per chunk, as in log.c */
+#define duration	60	/* seconds of flight */
+
+enum { bat = 0, imu = 1, mag = 2, cmd = 3, meas = 3 + nrotors };
+
+static struct rc_logz_field field[2 + 3 + 1 + 13 + 6 + 3 * nrotors];
+static size_t nfield;
+
+static void
+fields(void)
+{
+  int i;
+
+#define xfield(t, p)	field[nfield++] = (struct rc_logz_field){ (t), (p) }
+  xfield(RC_LOGZ_U64, -1);
+  xfield(RC_LOGZ_U32, -1);
+  for(i = 0; i < 3; i++) xfield(RC_LOGZ_F32, -1);
+  xfield(RC_LOGZ_F32, bat);
+  for(i = 0; i < 13; i++) xfield(RC_LOGZ_F32, imu);
+  for(i = 0; i < 6; i++) xfield(RC_LOGZ_F32, mag);
+  for(i = 0; i < nrotors; i++) xfield(RC_LOGZ_F32, cmd + i);
+  for(i = 0; i < nrotors; i++) xfield(RC_LOGZ_F32, meas + i);
+  for(i = 0; i < nrotors; i++) xfield(RC_LOGZ_U8, -1);
+#undef xfield
+}
+
+/* Fill n records at rate Hz: imu data in every record, magnetometer at
+ * 100Hz, motors at 1kHz and battery at 1Hz, absent fields being NaN. */
+static void
+records(uint8_t *rec, size_t reclen, size_t n, double rate)
+{
+  uint64_t ts = 1700000000000000000ULL;
+  uint32_t present;
+  size_t k, i;
+  uint8_t *p;
+  double t;
+  float f;
+
+  srand48(1);
+  for(k = 0; k < n; k++, rec += reclen) {
+    t = k / rate;
+    ts += 1e9 / rate + (lrand48() % 20000) - 10000;
+    present = 1U << imu;
+    if (!(k % (size_t)(rate / 100.))) present |= 1U << mag;
+    if (!(k % (size_t)rate)) present |= 1U << bat;
+    if (!(k % (size_t)(rate / 1000.)))
+      for(i = 0; i < nrotors; i++)
+        present |= 1U << (cmd + i) | 1U << (meas + i);
+
+    p = rec;
+    memcpy(p, &ts, sizeof(ts)); p += sizeof(ts);
+    memcpy(p, &present, sizeof(present)); p += sizeof(present);
+    for(i = 0; i < nfield - 2; i++) {
+      const struct rc_logz_field *x = &field[2 + i];
+
+      if (x->type == RC_LOGZ_U8) {
+        *p++ = 50 + (k / 100) % 3;
+        continue;
+      }
+      if (x->present >= 0 && !(present & (1U << x->present)))
+        f = NAN;
+      else if (i < 3)
+        f = rate;
+      else
+        f = (float)(sin(t * (1 + i % 7)) * (1 + i) +
+                    0.01 * (drand48() - 0.5));
+      memcpy(p, &f, sizeof(f)); p += sizeof(f);
+    }
+  }
+}
+
+static double
+cpu(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+  return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static int
+roundtrip(double rate)
+{
+  struct rc_logz enc, dec;
+  uint8_t *rec, *out, *data;
+  size_t reclen, n, k, l, len;
+  double t0, te, td;
+  int s;
+
+  if (rc_logz_init(&enc, field, nfield, chunk)) err(2, "rc_logz_init");
+  if (rc_logz_init(&dec, field, nfield, 0)) err(2, "rc_logz_init");
+  reclen = enc.reclen;
+  n = duration * rate;
+
+  rec = malloc(n * reclen);
+  out = malloc(n * reclen);
+  data = malloc((n / chunk + 1) * enc.size);
+  if (!rec || !out || !data) err(2, NULL);
+  records(rec, reclen, n, rate);
+
+  /* encode */
+  t0 = cpu();
+  len = 0;
+  for(k = 0; k < n; k++) {
+    s = rc_logz_encode(&enc, rec + k * reclen);
+    if (s < 0) err(2, "rc_logz_encode");
+    if (s || k == n - 1) {
+      l = rc_logz_flush(&enc);
+      memcpy(data + len, enc.buf, l);
+      len += l;
+    }
+  }
+  te = cpu() - t0;
+
+  /* decode */
+  t0 = cpu();
+  for(k = l = 0; l < len; ) {
+    struct rc_logz_hdr h;
+
+    memcpy(&h, data + l, sizeof(h));
+    s = rc_logz_decode(&dec, data + l, len - l, out + k * reclen);
+    if (s < 0) err(2, "rc_logz_decode");
+    k += s;
+    l += sizeof(h) + h.len;
+  }
+  td = cpu() - t0;
+
+  s = k != n || memcmp(rec, out, n * reclen);
+  printf("%4.0fHz: %zu records, %.1fx smaller than binary\n"
+         "        encode %.0f records/s, %.0f ns/record, %.3f%% of a CPU\n"
+         "        decode %.0f records/s, %.0f ns/record\n",
+         rate, n, (double)n * reclen / len,
+         n / te, 1e9 * te / n, 100. * te / duration,
+         n / td, 1e9 * td / n);
+  if (s) warnx("%.0fHz: decoded records differ", rate);
+
+  rc_logz_fini(&enc);
+  rc_logz_fini(&dec);
+  free(data);
+  free(out);
+  free(rec);
+  return s;
+}
+
+int
+main()
+{
+  int s;
+
+  fields();
+  s = roundtrip(1000.);
+  s |= roundtrip(2000.);
+  return s;
+}
@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAVE_LOW_LATENCY_IOCTL
@@ -406,6 +407,8 @@ mk_recv_msg(struct mk_channel_s *chan, bool block)
 
 /* --- mk_send_msg --------------------------------------------------------- */
 
+static ssize_t	mk_format_msg(char *buf, size_t len, const char *fmt,
+                        va_list ap);
 static void	mk_encode(char x, char **buf);
 
 int
@@ -413,25 +416,215 @@ mk_send_msg(const struct mk_channel_s *chan, const char *fmt, ...)
 {
   va_list ap;
   ssize_t s;
-  char buf[64], *w, *r;
-  char c;
+  char buf[64];
 
   if (chan->fd < 0) return -1;
 
-  w = buf;
+  va_start(ap, fmt);
+  s = mk_format_msg(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (s < 0) return -1;
+
+  return mk_write_msg(chan->fd, buf, s);
+}
+
+
+/* --- mk_defer_msg -------------------------------------------------------- */
+
+/* Encode a message for later transmission by mk_flush_msg. Any previously
+ * deferred message is discarded. */
+
+int
+mk_defer_msg(struct mk_channel_s *chan, const char *fmt, ...)
+{
+  va_list ap;
+  ssize_t s;
+
+  chan->sync.len = 0;
+  if (chan->fd < 0) return -1;
 
   va_start(ap, fmt);
+  s = mk_format_msg((char *)chan->sync.buf, sizeof(chan->sync.buf), fmt, ap);
+  va_end(ap);
+  if (s < 0) return -1;
+
+  chan->sync.len = s;
+  return 0;
+}
+
+
+/* --- mk_flush_msg -------------------------------------------------------- */
+
+/* Send the message deferred by mk_defer_msg, if any and unless an emergency
+ * stop is latched */
+
+int
+mk_flush_msg(const rotorcraft_conn_s *conn, struct mk_channel_s *chan)
+{
+  uint8_t len;
+  int s;
+
+  if (!mk_estop_lock(conn)) { errno = ECANCELED; return -1; }
+  len = chan->sync.len;
+  chan->sync.len = 0;
+  if (!len)
+    s = 0;
+  else if (chan->fd < 0)
+    s = -1;
+  else
+    s = mk_write_msg(chan->fd, (char *)chan->sync.buf, len);
+  mk_estop_unlock(conn);
+
+  return s;
+}
+
+
+/* --- mk_write_msg -------------------------------------------------------- */
+
+int
+mk_write_msg(int fd, const char *buf, size_t len)
+{
+  ssize_t s;
+
+  while (len > 0) {
+    do {
+      s = write(fd, buf, len);
+    } while (s < 0 && errno == EINTR);
+    if (s < 0) return -1;
+
+    buf += s;
+    len -= s;
+  }
+
+  return 0;
+}
+
+
+/* --- mk_estop ------------------------------------------------------------ */
+
+/* Stop all motors as fast as possible: the emergency stop latch is set so
+ * that no setpoint is transmitted anymore until the next start, setpoints
+ * not yet transmitted are discarded and a precomputed stop message is
+ * written immediately on all channels. The leading ^ makes the hardware drop
+ * any partially received message. Setpoint output holds the latch lock while
+ * writing, so a setpoint being written delays the stop by at most one
+ * non-blocking write() and cannot be written after it. The worst case time
+ * taken by write() over all channels is returned in latency, if not NULL:
+ * this is the time to queue the message in the kernel, not to transmit it. */
+
+int
+mk_estop(const rotorcraft_conn_s *conn, double *latency)
+{
+  static const char stop[] = { '^', 'x', '$' };
+
+  struct mk_channel_s *chan;
+  struct timespec start, now;
+  const char *r;
+  size_t l;
+  ssize_t s;
+  uint32_t i, retry;
+  int e, err;
+  double d;
+
+  e = errno;
+  err = 0;
+  if (latency) *latency = 0.;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (conn->estop) {
+    pthread_mutex_lock(&conn->estop->lock);
+    conn->estop->latched = true;
+  }
+
+  for(i = 0; i < conn->n; i++) {
+    chan = &conn->chan[i];
+    chan->sync.len = 0;
+    chan->sp.cmd = 0;
+    if (chan->fd < 0) continue;
+
+    /* discard pending output */
+    tcflush(chan->fd, TCOFLUSH);
+
+    r = stop;
+    l = sizeof(stop);
+    for(retry = 0; l > 0 && retry < 100; retry++) {
+      s = write(chan->fd, r, l);
+      if (s < 0) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        break;
+      }
+      r += s;
+      l -= s;
+    }
+    if (l > 0) { e = errno; err = -1; continue; }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    d = now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) * 1e-9;
+    if (chan->estop < d) chan->estop = d;
+    if (latency && *latency < d) *latency = d;
+  }
+
+  if (conn->estop) pthread_mutex_unlock(&conn->estop->lock);
+  errno = e;
+  return err;
+}
+
+
+/* --- mk_estop_lock ------------------------------------------------------- */
+
+/* Get exclusive access to setpoint output, unless an emergency stop is
+ * latched. Returns true if setpoints can be sent, and mk_estop_unlock must
+ * then be called when done. */
+
+bool
+mk_estop_lock(const rotorcraft_conn_s *conn)
+{
+  if (!conn->estop) return true;
+
+  pthread_mutex_lock(&conn->estop->lock);
+  if (!conn->estop->latched) return true;
+
+  pthread_mutex_unlock(&conn->estop->lock);
+  return false;
+}
+
+void
+mk_estop_unlock(const rotorcraft_conn_s *conn)
+{
+  if (conn->estop) pthread_mutex_unlock(&conn->estop->lock);
+}
+
+/* Allow setpoints again, on start */
+
+void
+mk_estop_clear(const rotorcraft_conn_s *conn)
+{
+  if (!conn->estop) return;
+
+  pthread_mutex_lock(&conn->estop->lock);
+  conn->estop->latched = false;
+  pthread_mutex_unlock(&conn->estop->lock);
+}
+
+
+/* --- mk_format_msg ------------------------------------------------------- */
+
+/* Encode a message in buf, returns the encoded length or -1 if it does not
+ * fit */
+
+static ssize_t
+mk_format_msg(char *buf, size_t len, const char *fmt, va_list ap)
+{
+  char *w;
+  char c;
+
+  w = buf;
   *w++ = '^';
   while((c = *fmt++)) {
-    while ((unsigned)(w - buf) > sizeof(buf)-8 /* 8 = worst case (4 bytes
-                                                * escaped) */) {
-      do {
-        s = write(chan->fd, buf, w - buf);
-      } while (s < 0 && errno == EINTR);
-      if (s < 0) return -1;
-
-      if (s > 0 && s < w - buf) memmove(buf, buf + s, w - buf - s);
-      w -= s;
+    if ((size_t)(w - buf) > len - 9 /* 9 = worst case (4 bytes escaped) and
+                                     * trailing $ */) {
+      errno = EMSGSIZE;
+      return -1;
     }
 
     switch(c) {
@@ -451,6 +644,10 @@ mk_send_msg(const struct mk_channel_s *chan, const char *fmt, ...)
             uint16_t *x = va_arg(ap, uint16_t *);
             size_t l = va_arg(ap, size_t);
             while (l--) {
+              if ((size_t)(w - buf) > len - 5) {
+                errno = EMSGSIZE;
+                return -1;
+              }
               mk_encode((*x >> 8) & 0xff, &w);
               mk_encode(*x & 0xff, &w);
               x++;
@@ -479,19 +676,8 @@ mk_send_msg(const struct mk_channel_s *chan, const char *fmt, ...)
     }
   }
   *w++ = '$';
-  va_end(ap);
-
-  r = buf;
-  while (w > r) {
-    do {
-      s = write(chan->fd, r, w - r);
-    } while (s < 0 && errno == EINTR);
-    if (s < 0) return -1;
 
-    r += s;
-  }
-
-  return 0;
+  return w - buf;
 }
 
 static void
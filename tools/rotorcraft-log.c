@@ -0,0 +1,861 @@
+/*
+ * Copyright (c) 2023 LAAS/CNRS
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logz.h"
+
+/* Offline tool for rotorcraft logs. The log is memory mapped, or read in
+ * memory when it is a pipe, and split in blocks: fixed size groups of records in binary logs, chunks in compressed
+ * logs and groups of lines in text logs. Blocks are converted in parallel to
+ * one numpy .npy array per column, in two passes: records in the selected
+ * time range are first counted in each block, then written at their final
+ * row in the memory mapped arrays. Logs can also be converted to text, with
+ * '-' for absent fields, and the block first timestamps, rows and offsets
+ * printed as a time index. */
+
+#define rc_log_blocksize	(1 << 20)	/* target block size, bytes */
+
+struct rc_log_column {
+  char *name;
+  size_t off, size;	/* in binary records */
+};
+
+struct rc_log_format {
+  enum { RC_LOG_TEXT, RC_LOG_BINARY, RC_LOG_COMPRESSED } kind;
+  char endian;		/* '<' or '>' */
+  size_t ncol, reclen;
+  char *line;		/* column line */
+  struct rc_log_column *col;
+  struct rc_logz_field *field;
+
+  /* mapped log */
+  const char *data, *body, *end;
+};
+
+struct rc_log_block {
+  const char *p, *end;
+  uint64_t ts;		/* first timestamp, ns */
+  size_t nrec;		/* records */
+  size_t row, nout;	/* first output row and records in range */
+};
+
+struct rc_log_npy {
+  char *map, *data;
+  size_t size, esize;
+};
+
+/* conversion thread */
+struct rc_log_job {
+  pthread_t thread;
+  int (*fn)(struct rc_log_job *job, struct rc_log_block *b);
+  atomic_size_t *next;
+  struct rc_log_block *block;
+  size_t nblock;
+
+  struct rc_logz z;
+  uint8_t *rec;		/* decoded chunk */
+  size_t maxrec;
+  char *line;		/* text record */
+  size_t size;
+  int err;
+};
+
+/* record iterator */
+struct rc_log_iter {
+  const char *p, *end;
+  const uint8_t *rec;	/* decoded chunk */
+  size_t i, n;
+
+  uint64_t ts;
+  const char *row;	/* record, or text line */
+  size_t len;
+};
+
+static const struct rc_log_format *fmt;
+static struct rc_log_npy *npy;
+static uint64_t from = 0, to = UINT64_MAX;
+
+static int	rc_log_load(int fd, struct rc_log_format *fmt);
+static int	rc_log_parse_header(struct rc_log_format *fmt, FILE *out,
+                        bool copy);
+static int	rc_log_parse_columns(char *line, struct rc_log_format *fmt);
+static const char *
+		rc_log_parse_ts(const char *p, const char *end, uint64_t *ts);
+static int	rc_log_blocks(struct rc_log_block **block, size_t *nblock);
+static int	rc_log_parallel(int jobs, struct rc_log_block *block,
+                        size_t nblock,
+                        int (*fn)(struct rc_log_job *, struct rc_log_block *));
+static int	rc_log_count(struct rc_log_job *job, struct rc_log_block *b);
+static int	rc_log_convert(struct rc_log_job *job, struct rc_log_block *b);
+static int	rc_log_npy_create(const char *dir, size_t nrow);
+static int	rc_log_npy_close(void);
+static int	rc_log_text(FILE *out, struct rc_log_block *block,
+                        size_t nblock);
+static void	rc_log_print(FILE *out, const uint8_t *rec);
+
+static void
+usage(FILE *f)
+{
+  fprintf(f,
+    "usage: rotorcraft-log [-h] [-x] [-j jobs] [-t from:to]"
+    " [-o output | -n dir] [log]\n"
+    "Convert a rotorcraft log to text or to numpy arrays.\n"
+    "  -o output\twrite text to output instead of standard output\n"
+    "  -n dir\twrite one numpy .npy array per column in dir\n"
+    "  -t from:to\tonly records with from <= ts < to, in seconds\n"
+    "\t\t(from or to may be omitted)\n"
+    "  -x\t\tprint the time index of the log: first ts, row, offset and\n"
+    "\t\tnumber of records of each block\n"
+    "  -j jobs\tnumber of conversion threads, default: processors count\n"
+    "  -h\t\tprint this help\n");
+}
+
+
+/* --- main ---------------------------------------------------------------- */
+
+int
+main(int argc, char *argv[])
+{
+  struct rc_log_format f = { .kind = RC_LOG_TEXT, .endian = '<' };
+  struct rc_log_block *block;
+  size_t nblock, nrow, i;
+  const char *dir = NULL;
+  FILE *out = stdout;
+  bool index = false;
+  char *s, *e;
+  int c, fd, jobs;
+
+  jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((c = getopt(argc, argv, "hj:n:o:t:x")) != -1)
+    switch(c) {
+      case 'j':
+        jobs = strtol(optarg, &e, 0);
+        if (*e || jobs < 1) errx(2, "bad number of jobs: %s", optarg);
+        break;
+
+      case 'n': dir = optarg; break;
+
+      case 'o':
+        out = fopen(optarg, "w");
+        if (!out) err(2, "%s", optarg);
+        break;
+
+      case 't':
+        s = strchr(optarg, ':');
+        if (!s) errx(2, "bad time range: %s", optarg);
+        e = s + strlen(s);
+        if ((s > optarg && rc_log_parse_ts(optarg, s, &from) != s) ||
+            (s[1] && rc_log_parse_ts(s + 1, e, &to) != e))
+          errx(2, "bad time range: %s", optarg);
+        break;
+
+      case 'x': index = true; break;
+
+      case 'h': usage(stdout); return 0;
+      default: usage(stderr); return 2;
+    }
+  argc -= optind;
+  argv += optind;
+  if (argc > 1) { usage(stderr); return 2; }
+  if (jobs < 1) jobs = 1;
+
+  /* map or read the log */
+  fd = argc > 0 ? open(argv[0], O_RDONLY) : STDIN_FILENO;
+  if (fd < 0) err(2, "%s", argv[0]);
+  if (rc_log_load(fd, &f)) err(2, "%s", argc > 0 ? argv[0] : "stdin");
+  close(fd);
+  if (f.end == f.data) return 0;
+  fmt = &f;
+
+  if (rc_log_parse_header(&f, out, !dir && !index)) errx(2, "bad log header");
+  if (rc_log_blocks(&block, &nblock)) errx(2, "corrupted log");
+
+  /* count records in range and assign output rows */
+  if (rc_log_parallel(jobs, block, nblock, rc_log_count)) err(2, "read");
+  for(nrow = i = 0; i < nblock; nrow += block[i++].nout) block[i].row = nrow;
+
+  if (index) {
+    fprintf(out, "# ts row offset records\n");
+    for(i = 0; i < nblock; i++)
+      if (block[i].nrec)
+        fprintf(out, "%" PRIu64 ".%09" PRIu64 " %zu %td %zu\n",
+                block[i].ts / 1000000000, block[i].ts % 1000000000,
+                block[i].row, block[i].p - f.data, block[i].nrec);
+  } else if (dir) {
+    if (rc_log_npy_create(dir, nrow)) err(2, "%s", dir);
+    if (rc_log_parallel(jobs, block, nblock, rc_log_convert)) err(2, "read");
+    if (rc_log_npy_close()) err(2, "%s", dir);
+  } else {
+    if (rc_log_text(out, block, nblock)) err(2, "read");
+  }
+
+  free(block);
+  free(f.field);
+  free(f.col);
+  free(f.line);
+  if (fclose(out)) err(2, "write");
+  return 0;
+}
+
+
+/* --- rc_log_load --------------------------------------------------------- */
+
+/* Map a regular file, or read other inputs (pipes, terminals) in a buffer
+ * doubled as needed. The log is left in fmt->data, up to fmt->end. */
+
+static int
+rc_log_load(int fd, struct rc_log_format *fmt)
+{
+  struct stat st;
+  size_t len, size;
+  ssize_t s;
+  char *b, *n;
+
+  if (fstat(fd, &st)) return -1;
+  if (S_ISREG(st.st_mode)) {
+    if (!st.st_size) {
+      fmt->data = fmt->end = "";
+      return 0;
+    }
+    b = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (b == MAP_FAILED) return -1;
+    madvise(b, st.st_size, MADV_SEQUENTIAL);
+    fmt->data = b;
+    fmt->end = b + st.st_size;
+    return 0;
+  }
+
+  b = NULL;
+  len = size = 0;
+  do {
+    if (len == size) {
+      size = size ? 2 * size : rc_log_blocksize;
+      n = realloc(b, size);
+      if (!n) { free(b); return -1; }
+      b = n;
+    }
+    s = read(fd, b + len, size - len);
+    if (s < 0 && errno == EINTR) continue;
+    if (s < 0) { free(b); return -1; }
+    len += s;
+  } while (s);
+
+  fmt->data = b;
+  fmt->end = b + len;
+  return 0;
+}
+
+
+/* --- rc_log_parse_header ------------------------------------------------- */
+
+/* Parse comments and the column line, optionally copied to out. */
+
+static int
+rc_log_parse_header(struct rc_log_format *fmt, FILE *out, bool copy)
+{
+  const char *p, *l;
+  int s;
+
+  for(p = fmt->data; p < fmt->end && *p == '#'; p = l + 1) {
+    l = memchr(p, '\n', fmt->end - p);
+    if (!l) return -1;
+
+    if (!strncmp(p, "# binary format", 15) && fmt->kind == RC_LOG_TEXT) {
+      fmt->kind = RC_LOG_BINARY;
+      if (l - p > 20 && !strncmp(p + 17, "big", 3)) fmt->endian = '>';
+    } else if (!strncmp(p, "# compressed chunks", 19))
+      fmt->kind = RC_LOG_COMPRESSED;
+    if (copy) fwrite(p, 1, l + 1 - p, out);
+  }
+  if (p >= fmt->end) return -1;
+
+  l = memchr(p, '\n', fmt->end - p);
+  if (!l) return -1;
+  fmt->line = strndup(p, l - p);
+  if (!fmt->line) err(2, NULL);
+  fmt->body = l + 1;
+
+  s = rc_log_parse_columns(fmt->line, fmt);
+  if (!s && copy) {
+    for(size_t i = 0; i < fmt->ncol; i++)
+      fprintf(out, "%s%s", i ? " " : "", fmt->col[i].name);
+    fputc('\n', out);
+  }
+  return s;
+}
+
+
+/* --- rc_log_parse_columns ------------------------------------------------ */
+
+/* Parse the columns line: names only in text logs, or name:type with an
+ * optional @presence bit in compressed logs. */
+
+static int
+rc_log_parse_columns(char *line, struct rc_log_format *fmt)
+{
+  static const struct {
+    const char *name;
+    enum rc_logz_type type;
+    size_t size;
+  } types[] = {
+    { "u64", RC_LOGZ_U64, 8 }, { "u32", RC_LOGZ_U32, 4 },
+    { "f32", RC_LOGZ_F32, 4 }, { "u8", RC_LOGZ_U8, 1 }
+  };
+  char *tok, *type, *bit, *save;
+  size_t i, off;
+
+  fmt->ncol = 0;
+  fmt->col = NULL;
+  fmt->field = NULL;
+  for(off = 0, tok = strtok_r(line, " \t", &save); tok;
+      tok = strtok_r(NULL, " \t", &save)) {
+    fmt->col = realloc(fmt->col, (fmt->ncol + 1) * sizeof(*fmt->col));
+    if (!fmt->col) err(2, NULL);
+    fmt->col[fmt->ncol].name = tok;
+
+    if (fmt->kind != RC_LOG_TEXT) {
+      type = strchr(tok, ':');
+      if (!type) return -1;
+      *type++ = 0;
+      bit = strchr(type, '@');
+      if (bit) *bit++ = 0;
+
+      for(i = 0; i < sizeof(types)/sizeof(*types); i++)
+        if (!strcmp(type, types[i].name)) break;
+      if (i >= sizeof(types)/sizeof(*types)) return -1;
+
+      fmt->field = realloc(fmt->field, (fmt->ncol + 1) * sizeof(*fmt->field));
+      if (!fmt->field) err(2, NULL);
+      fmt->field[fmt->ncol].type = types[i].type;
+      fmt->field[fmt->ncol].present = bit ? atoi(bit) : -1;
+      fmt->col[fmt->ncol].off = off;
+      fmt->col[fmt->ncol].size = types[i].size;
+      off += types[i].size;
+    }
+    fmt->ncol++;
+  }
+  if (fmt->ncol < 1) return -1;
+  if (fmt->kind == RC_LOG_TEXT) return 0;
+
+  if (fmt->ncol < 2 ||
+      fmt->field[0].type != RC_LOGZ_U64 || fmt->field[1].type != RC_LOGZ_U32)
+    return -1;
+
+  fmt->reclen = rc_logz_reclen(fmt->field, fmt->ncol);
+  return 0;
+}
+
+
+/* --- rc_log_blocks ------------------------------------------------------- */
+
+/* Split the log body in blocks. */
+
+static int
+rc_log_blocks(struct rc_log_block **block, size_t *nblock)
+{
+  struct rc_logz_hdr h;
+  const char *p, *e;
+  size_t n, k, size;
+
+  *block = NULL;
+  *nblock = size = 0;
+
+#define xadd(b)                                                         \
+  do {                                                                  \
+    if (*nblock >= size) {                                              \
+      size = size ? 2 * size : 64;                                      \
+      *block = realloc(*block, size * sizeof(**block));                 \
+      if (!*block) err(2, NULL);                                        \
+    }                                                                   \
+    (*block)[(*nblock)++] = (b);                                        \
+  } while(0)
+
+  switch(fmt->kind) {
+    case RC_LOG_BINARY:
+      k = rc_log_blocksize / fmt->reclen;
+      if (!k) k = 1;
+      n = (fmt->end - fmt->body) / fmt->reclen;
+      for(p = fmt->body; n > 0; n -= k, p += k * fmt->reclen) {
+        if (k > n) k = n;
+        struct rc_log_block b = {
+          .p = p, .end = p + k * fmt->reclen, .nrec = k, .nout = 0
+        };
+        memcpy(&b.ts, p, sizeof(b.ts));
+        xadd(b);
+      }
+      break;
+
+    case RC_LOG_COMPRESSED:
+      for(p = fmt->body; p + sizeof(h) <= fmt->end; p += sizeof(h) + h.len) {
+        memcpy(&h, p, sizeof(h));
+        if (h.magic != RC_LOGZ_MAGIC ||
+            h.len > (size_t)(fmt->end - p) - sizeof(h)) {
+          warnx("bad chunk at offset %td", p - fmt->data);
+          break;
+        }
+        xadd(((struct rc_log_block){
+              .p = p, .end = p + sizeof(h) + h.len, .ts = h.ts,
+              .nrec = h.nrec, .nout = 0 }));
+      }
+      break;
+
+    case RC_LOG_TEXT:
+      for(p = fmt->body; p < fmt->end; p = e) {
+        e = p + rc_log_blocksize;
+        if (e >= fmt->end)
+          e = fmt->end;
+        else {
+          e = memchr(e, '\n', fmt->end - e);
+          e = e ? e + 1 : fmt->end;
+        }
+        xadd(((struct rc_log_block){
+              .p = p, .end = e, .ts = 0, .nrec = 0, .nout = 0 }));
+      }
+      break;
+  }
+#undef xadd
+
+  return 0;
+}
+
+
+/* --- rc_log_iter --------------------------------------------------------- */
+
+/* Parse a timestamp in seconds, sec[.nsec], exactly. Returns the end of the
+ * timestamp or NULL. */
+
+static const char *
+rc_log_parse_ts(const char *p, const char *end, uint64_t *ts)
+{
+  uint64_t s = 0, ns = 0;
+  int i;
+
+  if (p >= end || *p < '0' || *p > '9') return NULL;
+  while (p < end && *p >= '0' && *p <= '9') s = 10 * s + (*p++ - '0');
+  if (p < end && *p == '.')
+    for(p++, i = 0; i < 9; i++) {
+      ns *= 10;
+      if (p < end && *p >= '0' && *p <= '9') ns += *p++ - '0';
+    }
+  while (p < end && *p >= '0' && *p <= '9') p++;
+
+  *ts = s * 1000000000 + ns;
+  return p;
+}
+
+static int
+rc_log_iter_init(struct rc_log_job *job, const struct rc_log_block *b,
+                 struct rc_log_iter *it)
+{
+  struct rc_logz_hdr h;
+  int n;
+
+  it->p = b->p;
+  it->end = b->end;
+  it->i = it->n = 0;
+  if (fmt->kind != RC_LOG_COMPRESSED) return 0;
+
+  /* decode the whole chunk */
+  memcpy(&h, b->p, sizeof(h));
+  if (h.nrec > job->maxrec) {
+    free(job->rec);
+    job->rec = malloc(h.nrec * fmt->reclen);
+    if (!job->rec) return -1;
+    job->maxrec = h.nrec;
+  }
+  n = rc_logz_decode(&job->z, b->p, b->end - b->p, job->rec);
+  if (n < 0) return -1;
+  it->rec = job->rec;
+  it->n = n;
+  return 0;
+}
+
+/* Get the next record, returns 0 at the end of the block. */
+
+static int
+rc_log_iter_next(struct rc_log_iter *it)
+{
+  const char *l = NULL;
+
+  switch(fmt->kind) {
+    case RC_LOG_BINARY:
+      if (it->p >= it->end) return 0;
+      it->row = it->p;
+      it->len = fmt->reclen;
+      it->p += fmt->reclen;
+      memcpy(&it->ts, it->row, sizeof(it->ts));
+      return 1;
+
+    case RC_LOG_COMPRESSED:
+      if (it->i >= it->n) return 0;
+      it->row = (const char *)it->rec + it->i++ * fmt->reclen;
+      it->len = fmt->reclen;
+      memcpy(&it->ts, it->row, sizeof(it->ts));
+      return 1;
+
+    case RC_LOG_TEXT:
+      /* skip comments and empty lines */
+      for(; it->p < it->end; it->p = l + 1) {
+        l = memchr(it->p, '\n', it->end - it->p);
+        if (!l) l = it->end;
+        if (rc_log_parse_ts(it->p, l, &it->ts)) break;
+      }
+      if (it->p >= it->end) return 0;
+      it->row = it->p;
+      it->len = l - it->p;
+      it->p = l + 1;
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/* --- rc_log_parallel ----------------------------------------------------- */
+
+static void *
+rc_log_job_main(void *arg)
+{
+  struct rc_log_job *job = arg;
+  size_t i;
+
+  while ((i = atomic_fetch_add(job->next, 1)) < job->nblock)
+    if (job->fn(job, &job->block[i])) {
+      job->err = errno ? errno : EIO;
+      break;
+    }
+
+  return NULL;
+}
+
+/* Apply fn to all blocks with jobs threads. */
+
+static int
+rc_log_parallel(int jobs, struct rc_log_block *block, size_t nblock,
+                int (*fn)(struct rc_log_job *, struct rc_log_block *))
+{
+  struct rc_log_job *job;
+  atomic_size_t next;
+  int i, e;
+
+  if ((size_t)jobs > nblock) jobs = nblock ? nblock : 1;
+  job = calloc(jobs, sizeof(*job));
+  if (!job) return -1;
+  atomic_init(&next, 0);
+
+  for(i = 0; i < jobs; i++) {
+    job[i].fn = fn;
+    job[i].next = &next;
+    job[i].block = block;
+    job[i].nblock = nblock;
+    if (fmt->kind == RC_LOG_COMPRESSED &&
+        rc_logz_init(&job[i].z, fmt->field, fmt->ncol, 0))
+      err(2, NULL);
+  }
+
+  /* the main thread runs the first job */
+  for(i = 1; i < jobs; i++) {
+    e = pthread_create(&job[i].thread, NULL, rc_log_job_main, &job[i]);
+    if (e) { errno = e; err(2, "pthread_create"); }
+  }
+  rc_log_job_main(&job[0]);
+
+  for(e = i = 0; i < jobs; i++) {
+    if (i) pthread_join(job[i].thread, NULL);
+    if (job[i].err) e = job[i].err;
+    if (fmt->kind == RC_LOG_COMPRESSED) rc_logz_fini(&job[i].z);
+    free(job[i].rec);
+    free(job[i].line);
+  }
+  free(job);
+
+  if (!e) return 0;
+  errno = e;
+  return -1;
+}
+
+
+/* --- rc_log_count -------------------------------------------------------- */
+
+/* Count records and records in range. */
+
+static int
+rc_log_count(struct rc_log_job *job, struct rc_log_block *b)
+{
+  const struct rc_log_block *next;
+  struct rc_log_iter it;
+
+  /* binary blocks entirely in or out of range */
+  next = b + 1 < job->block + job->nblock ? b + 1 : NULL;
+  if (fmt->kind != RC_LOG_TEXT) {
+    if (b->ts >= to || (next && next->ts < from)) return 0;
+    if (b->ts >= from && next && next->ts < to) {
+      b->nout = b->nrec;
+      return 0;
+    }
+  }
+
+  if (rc_log_iter_init(job, b, &it)) return -1;
+  while (rc_log_iter_next(&it)) {
+    if (fmt->kind == RC_LOG_TEXT && !b->nrec++) b->ts = it.ts;
+    if (it.ts >= from && it.ts < to) b->nout++;
+  }
+
+  return 0;
+}
+
+
+/* --- rc_log_convert ------------------------------------------------------ */
+
+/* Write records in range in the numpy arrays. */
+
+static int
+rc_log_convert(struct rc_log_job *job, struct rc_log_block *b)
+{
+  struct rc_log_iter it;
+  size_t row, i;
+  char *p, *e;
+  double v;
+
+  if (!b->nout) return 0;
+  if (rc_log_iter_init(job, b, &it)) return -1;
+
+  row = b->row;
+  while (row < b->row + b->nout && rc_log_iter_next(&it)) {
+    if (it.ts < from || it.ts >= to) continue;
+
+    if (fmt->kind != RC_LOG_TEXT) {
+      for(i = 0; i < fmt->ncol; i++)
+        memcpy(npy[i].data + row * npy[i].esize,
+               it.row + fmt->col[i].off, fmt->col[i].size);
+      row++;
+      continue;
+    }
+
+    /* text: NUL terminated copy of the line for strtod() */
+    if (it.len >= job->size) {
+      free(job->line);
+      job->size = it.len + 1;
+      job->line = malloc(job->size);
+      if (!job->line) return -1;
+    }
+    memcpy(job->line, it.row, it.len);
+    job->line[it.len] = 0;
+
+    memcpy(npy[0].data + row * npy[0].esize, &it.ts, sizeof(it.ts));
+    for(p = strchr(job->line, ' '), i = 1; i < fmt->ncol; i++) {
+      while (p && *p == ' ') p++;
+      if (!p || !*p)
+        v = NAN;
+      else if (*p == '-' && (p[1] == ' ' || !p[1])) {
+        v = NAN;
+        p++;
+      } else {
+        v = strtod(p, &e);
+        p = e == p ? NULL : e;
+      }
+      memcpy(npy[i].data + row * npy[i].esize, &v, sizeof(v));
+    }
+    row++;
+  }
+
+  return 0;
+}
+
+
+/* --- rc_log_npy ---------------------------------------------------------- */
+
+/* Create and map one .npy array of nrow elements per column. Text logs
+ * columns are float64 except for the timestamp, binary logs keep their
+ * column type. */
+
+static int
+rc_log_npy_create(const char *dir, size_t nrow)
+{
+  static const char *descr[] = {
+    [RC_LOGZ_U64] = "u8", [RC_LOGZ_U32] = "u4",
+    [RC_LOGZ_F32] = "f4", [RC_LOGZ_U8] = "u1"
+  };
+  char path[PATH_MAX], hdr[128], endian;
+  size_t i, hlen, esize;
+  const char *d;
+  int fd, l;
+
+  if (mkdir(dir, 0777) && errno != EEXIST) return -1;
+
+  endian = fmt->endian;
+  if (fmt->kind == RC_LOG_TEXT)
+    endian = (union { uint16_t i; uint8_t c[2]; }){ .i = 1 }.c[0] ? '<' : '>';
+
+  npy = calloc(fmt->ncol, sizeof(*npy));
+  if (!npy) return -1;
+
+  for(i = 0; i < fmt->ncol; i++) {
+    if (fmt->kind == RC_LOG_TEXT) {
+      d = i ? "f8" : "u8";
+      esize = 8;
+    } else {
+      d = descr[fmt->field[i].type];
+      esize = fmt->col[i].size;
+    }
+
+    /* version 1.0 header, padded to 64 bytes */
+    l = snprintf(hdr, sizeof(hdr),
+                 "{'descr': '%c%s', 'fortran_order': False, 'shape': (%zu,), }",
+                 esize > 1 ? endian : '|', d, nrow);
+    hlen = (10 + l + 1 + 63) / 64 * 64;
+
+    snprintf(path, sizeof(path), "%s/%s.npy", dir, fmt->col[i].name);
+    fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, hlen + nrow * esize)) { close(fd); return -1; }
+
+    npy[i].size = hlen + nrow * esize;
+    npy[i].esize = esize;
+    npy[i].map = mmap(NULL, npy[i].size, PROT_READ|PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    close(fd);
+    if (npy[i].map == MAP_FAILED) return -1;
+
+    memcpy(npy[i].map, "\x93NUMPY\x01\x00", 8);
+    npy[i].map[8] = (hlen - 10) & 0xff;
+    npy[i].map[9] = (hlen - 10) >> 8;
+    memcpy(npy[i].map + 10, hdr, l);
+    memset(npy[i].map + 10 + l, ' ', hlen - 10 - l - 1);
+    npy[i].map[hlen - 1] = '\n';
+    npy[i].data = npy[i].map + hlen;
+  }
+
+  return 0;
+}
+
+static int
+rc_log_npy_close(void)
+{
+  size_t i;
+  int s = 0;
+
+  for(i = 0; i < fmt->ncol; i++)
+    if (munmap(npy[i].map, npy[i].size)) s = -1;
+  free(npy);
+  return s;
+}
+
+
+/* --- rc_log_text --------------------------------------------------------- */
+
+/* Text output. Text logs are copied as is, unless a time range is given. */
+
+static int
+rc_log_text(FILE *out, struct rc_log_block *block, size_t nblock)
+{
+  struct rc_log_job job = { .maxrec = 0, .rec = NULL };
+  struct rc_log_iter it;
+  size_t i;
+
+  if (fmt->kind == RC_LOG_TEXT && from == 0 && to == UINT64_MAX) {
+    fwrite(fmt->body, 1, fmt->end - fmt->body, out);
+    return ferror(out) ? -1 : 0;
+  }
+
+  if (fmt->kind == RC_LOG_COMPRESSED &&
+      rc_logz_init(&job.z, fmt->field, fmt->ncol, 0))
+    return -1;
+
+  for(i = 0; i < nblock; i++) {
+    if (!block[i].nout) continue;
+    if (rc_log_iter_init(&job, &block[i], &it)) break;
+
+    while (rc_log_iter_next(&it)) {
+      if (it.ts < from || it.ts >= to) continue;
+      if (fmt->kind == RC_LOG_TEXT) {
+        fwrite(it.row, 1, it.len, out);
+        fputc('\n', out);
+      } else
+        rc_log_print(out, (const uint8_t *)it.row);
+    }
+  }
+
+  if (fmt->kind == RC_LOG_COMPRESSED) rc_logz_fini(&job.z);
+  free(job.rec);
+  return i < nblock ? -1 : 0;
+}
+
+
+/* --- rc_log_print -------------------------------------------------------- */
+
+/* Print a record as text: ts in seconds, and '-' for absent or NaN fields */
+
+static void
+rc_log_print(FILE *out, const uint8_t *rec)
+{
+  uint32_t present = 0, u32;
+  uint64_t u64;
+  size_t i;
+  float f;
+
+  for(i = 0; i < fmt->ncol; i++) {
+    if (i) fputc(' ', out);
+
+    switch(fmt->field[i].type) {
+      case RC_LOGZ_U64:
+        memcpy(&u64, rec, sizeof(u64));
+        rec += sizeof(u64);
+        if (i)
+          fprintf(out, "%" PRIu64, u64);
+        else
+          fprintf(out, "%" PRIu64 ".%09" PRIu64,
+                  u64 / 1000000000, u64 % 1000000000);
+        break;
+
+      case RC_LOGZ_U32:
+        memcpy(&u32, rec, sizeof(u32));
+        rec += sizeof(u32);
+        if (i == 1) present = u32;
+        fprintf(out, "0x%" PRIx32, u32);
+        break;
+
+      case RC_LOGZ_F32:
+        memcpy(&f, rec, sizeof(f));
+        rec += sizeof(f);
+        if (isnan(f) || (fmt->field[i].present >= 0 &&
+                         !(present & (1U << fmt->field[i].present))))
+          fputc('-', out);
+        else
+          fprintf(out, "%g", f);
+        break;
+
+      case RC_LOGZ_U8:
+        fprintf(out, "%d", *rec++);
+        break;
+    }
+  }
+  fputc('\n', out);
+}